@@ -0,0 +1,829 @@
+/*
+ * Microbenchmarks for the bounded buffer in producer_consumer.c
+ *
+ * Drives insert_item()/remove_item() in tight loops, without thread startup,
+ * printf, rand_r or clock reads per item:
+ *   uncontended  one thread, insert then remove (never blocks)
+ *   half full    same, with capacity/2 items parked in the buffer
+ *   ping-pong    two pinned threads over a 1-slot buffer, so every item is a
+ *                handoff from one thread to the other
+ *   contended    N pinned threads, each doing insert+remove pairs
+ * The first two are then repeated at a power-of-two capacity (--capacity
+ * rounded up), once with indices wrapped by a mask and once forced onto the
+ * general % path, to show what the mask saves.
+ * A last table times a producer's item generation alone: rand_r() twice and
+ * gettimeofday() per item, as the demo used to, against fill_batch() with
+ * gettimeofday() or with the calibrated TSC clock.
+ * An op is one insert or one remove. ns/op is wall time, from the first
+ * thread entering its loop to the last one leaving it, divided by all ops
+ * (the inverse of aggregate throughput). Each case runs one warmup repetition
+ * and then --reps measured ones, and reports mean, stddev and min.
+ *
+ * A second set of cases sends variable-length messages (log-uniform sizes
+ * between --msg-min and --msg-max bytes) through three backends with the
+ * same --ring-bytes of storage:
+ *   byte ring    byte_ring.h, length-prefixed records copied in and out
+ *   fixed slots  a bounded_queue.h FIFO of slots sized for the largest message
+ *   pointers     a bounded_queue.h FIFO of malloc'd copies, freed on receipt
+ * Each runs in one thread (send then receive) and as a sender/receiver pair.
+ *
+ * A third set passes fixed-size payloads (64 B to --msg-max) from a sender
+ * to a receiver. Both sides write or read every cache line of the payload:
+ *   copy     the sender fills a local buffer, the byte ring copies it
+ *            through, the receiver reads its copy
+ *   handle   the sender fills a payload_pool.h buffer in place and sends
+ *            its handle through a byte ring of the same depth, the receiver
+ *            reads it in place and releases it
+ *
+ * Build: gcc -O2 -o bench_queue bench_queue.c -pthread -lm
+ * Usage: ./bench_queue [--reps=N] [--iters=N] [--threads=N] [--capacity=N]
+ *                      [--msg-min=B] [--msg-max=B] [--ring-bytes=B]
+ *                      [producer_consumer options, e.g. --policy=edf --levels=8]
+ */
+#define _GNU_SOURCE  // pthread_setaffinity_np
+#define PC_NO_MAIN   // reuse the queue, not the demo's main()
+#include "producer_consumer.c"
+
+#include <sched.h>
+
+#include "byte_ring.h"
+#include "payload_pool.h"
+
+/* What a benchmark thread does in its loop */
+#define BENCH_PAIRS 0  // insert then remove
+#define BENCH_PUT 1    // insert only
+#define BENCH_TAKE 2   // remove only
+
+typedef struct {
+    int slot;     // index among the repetition's threads
+    int cpu;      // pin to this CPU, -1 = no pinning
+    int role;     // BENCH_PAIRS, BENCH_PUT or BENCH_TAKE
+    long iters;
+    pthread_barrier_t *start;
+    long t_start;  // this thread's own loop, timed after the barrier
+    long t_end;
+} bench_thread;
+
+/* Variable-length message backends */
+#define MSG_BYTE_RING 0  // byte_ring.h records
+#define MSG_FIXED 1      // fixed slots of msg_max bytes
+#define MSG_POINTER 2    // each slot points to a malloc'd copy
+
+#define MSG_SIZES 4096  // sizes cycle through this table, so sender and receiver agree
+
+/* A message in a fixed-slot or pointer FIFO */
+typedef struct {
+    unsigned char *data;
+    uint32_t len;
+} msg_ref;
+
+BQ_TYPE(msg_fifo, msg_ref)
+BQ_DEFINE_FIFO(msg_fifo, msg_ref, 0, BQ_SEM_WAIT, 0)
+
+/* Item generation variants */
+#define GEN_LIBC 0   // rand_r() x2 + gettimeofday() per item
+#define GEN_BATCH_GTOD 1  // fill_batch() + gettimeofday()
+#define GEN_BATCH_TSC 2   // fill_batch() + TSC clock
+
+/* Payload passing backends */
+#define PAYLOAD_COPY 0    // bytes copied through the byte ring
+#define PAYLOAD_HANDLE 1  // pool buffer filled in place, only its handle sent
+
+/* Benchmark options */
+int bench_reps = 5;
+long bench_iters = 1000000;
+int bench_max_threads = 8;
+int bench_capacity = 64;
+int bench_cpus = 1;
+int bench_modulo = 0;  // wrap indices with % even when the capacity is a power of two
+thread_stats **bench_stats;  // [slot]: registered once, reused by every repetition
+struct timeval bench_epoch;  // one timestamp for every item: no clock reads in the loop
+
+/* Message benchmark options and state */
+size_t msg_min = 16;
+size_t msg_max = 65536;
+size_t ring_bytes = 1 << 20;
+uint32_t msg_size[MSG_SIZES];
+double msg_mean;  // mean of msg_size[]
+int msg_backend;
+byte_ring msg_ring;
+msg_fifo msg_queue;
+unsigned char *msg_slab;  // MSG_FIXED slot storage
+long msg_errors;          // received lengths that did not match what was sent
+size_t payload_size;      // payload cases: bytes per message
+int payload_backend;
+volatile long gen_sink;   // keeps the generated fields alive
+
+/* Function prototypes */
+void bench_setup(int capacity);
+void bench_teardown(void);
+item bench_item(long i);
+item bench_take(void);
+void *bench_worker(void *param);
+long bench_wall(const bench_thread *bt, int threads);
+double bench_once(int threads, const int *roles, long iters, int capacity, int prefill);
+double bench_case(const char *name, int threads, const int *roles, long iters,
+                  int capacity, int prefill);
+void bench_summary(const double *ns, int n, double *mean, double *sd, double *best);
+void msg_setup_sizes(void);
+int msg_slots(void);
+void msg_send(const unsigned char *src, uint32_t len);
+uint32_t msg_receive(unsigned char *dst);
+void *msg_worker(void *param);
+double msg_once(int backend, int threads, const int *roles, long msgs);
+void msg_case(const char *name, int backend, int threads, const int *roles, long msgs);
+int payload_slots(void);
+void *payload_worker(void *param);
+double payload_once(int backend, long msgs);
+double payload_case(int backend, long msgs);
+double gen_once(int kind, long n);
+void gen_case(const char *name, int kind, long n);
+
+/**
+ * Allocate and reset the queue for one repetition
+ */
+void bench_setup(int capacity) {
+    buffer_size = capacity;
+    item_queue_init(&queue, buffer_size);
+    buffer = queue.slots;
+    buffer_mask = (queue.masked && !bench_modulo) ? buffer_size - 1 : -1;
+    queue.masked = (buffer_mask >= 0);
+    if (policy == POLICY_LEVELS || policy == POLICY_DRR) {
+        level_fifos_init();
+    }
+    if (policy == POLICY_KEYED) {
+        num_consumers = 1;  // a single lane, so every item meets every thread
+        lanes = (lane *)calloc(1, sizeof(lane));
+        item_fifo_init(&lanes[0].q, buffer_size);
+        lanes[0].q.masked = queue.masked;
+    }
+    heap_count = 0;
+    buffer_count = 0;
+    level_bitmap = 0;
+    memset(level_head, 0, sizeof(level_head));
+    memset(level_count, 0, sizeof(level_count));
+    memset(drr_deficit, 0, sizeof(drr_deficit));
+    drr_current = 0;
+}
+
+/**
+ * Free what bench_setup() allocated
+ */
+void bench_teardown(void) {
+    item_queue_destroy(&queue);
+    level_fifos_destroy();
+    if (lanes != NULL) {
+        item_fifo_destroy(&lanes[0].q);
+        free(lanes);
+        lanes = NULL;
+    }
+}
+
+/**
+ * Item number i: the producer's priority mix, deadlines spread over a second
+ */
+item bench_item(long i) {
+    item it;
+    it.value = (int)i;
+    if (num_levels == 2) {
+        it.priority = (i % 4 == 0) ? 1 : 0;  // 25% urgent
+    } else {
+        it.priority = i % num_levels;
+    }
+    it.timestamp = bench_epoch;
+    it.deadline.tv_sec = bench_epoch.tv_sec + 1;
+    it.deadline.tv_usec = (i * 7919) % 1000000;  // scrambled, so EDF reorders
+    it.producer_id = 0;
+    it.seq = (int)i;
+    it.payload = -1;
+    return it;
+}
+
+/**
+ * Remove one item under the configured policy
+ */
+item bench_take(void) {
+    if (policy == POLICY_KEYED) {
+        return remove_lane_item(0);
+    }
+    return remove_item();
+}
+
+/**
+ * Benchmark thread: pin, wait for the start barrier, run the loop
+ */
+void *bench_worker(void *param) {
+    bench_thread *bt = (bench_thread *)param;
+    if (bt->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(bt->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    if (bench_stats[bt->slot] == NULL) {
+        register_thread(bt->role == BENCH_TAKE ? 'C' : 'P', bt->slot + 1);  // as in the demo
+        bench_stats[bt->slot] = my_stats;
+    }
+    my_stats = bench_stats[bt->slot];
+    item it = bench_item(0);
+    pthread_barrier_wait(bt->start);
+    bt->t_start = now_ns();
+
+    for (long i = 0; i < bt->iters; i++) {
+        if (bt->role != BENCH_TAKE) {
+            it.seq = (int)i;
+            it.priority = (num_levels == 2) ? (i % 4 == 0) : i % num_levels;
+            insert_item(it);
+        }
+        if (bt->role != BENCH_PUT) {
+            it = bench_take();
+        }
+    }
+    bt->t_end = now_ns();
+    return NULL;
+}
+
+/**
+ * Wall time of a repetition: first thread's start to last thread's end
+ */
+long bench_wall(const bench_thread *bt, int threads) {
+    long first = bt[0].t_start, last = bt[0].t_end;
+    for (int t = 1; t < threads; t++) {
+        if (bt[t].t_start < first) {
+            first = bt[t].t_start;
+        }
+        if (bt[t].t_end > last) {
+            last = bt[t].t_end;
+        }
+    }
+    return last - first;
+}
+
+/**
+ * One repetition: returns wall-clock ns per op
+ */
+double bench_once(int threads, const int *roles, long iters, int capacity, int prefill) {
+    pthread_t tids[threads];
+    bench_thread bt[threads];
+    pthread_barrier_t start;
+    long ops = 0;
+
+    bench_setup(capacity);
+    for (int i = 0; i < prefill; i++) {
+        insert_item(bench_item(i));
+    }
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        bt[t].slot = t;
+        bt[t].cpu = (bench_cpus > 1) ? t % bench_cpus : -1;
+        bt[t].role = roles[t];
+        bt[t].iters = iters;
+        bt[t].start = &start;
+        ops += (roles[t] == BENCH_PAIRS) ? 2 * iters : iters;
+        pthread_create(&tids[t], NULL, bench_worker, &bt[t]);
+    }
+    pthread_barrier_wait(&start);
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    pthread_barrier_destroy(&start);
+    bench_teardown();
+    return (double)bench_wall(bt, threads) / ops;
+}
+
+/**
+ * Run one case: a warmup, then bench_reps measured repetitions; returns the
+ * mean ns per op
+ */
+double bench_case(const char *name, int threads, const int *roles, long iters,
+                  int capacity, int prefill) {
+    double ns[bench_reps];
+    double mean, sd, best;
+
+    bench_once(threads, roles, iters, capacity, prefill);  // warmup
+    for (int r = 0; r < bench_reps; r++) {
+        ns[r] = bench_once(threads, roles, iters, capacity, prefill);
+    }
+    bench_summary(ns, bench_reps, &mean, &sd, &best);
+    printf("%-22s %9.1f ns/op  +-%5.1f%%  min %9.1f  %12.0f ops/s\n",
+           name, mean, mean > 0 ? 100.0 * sd / mean : 0.0, best, mean > 0 ? 1e9 / mean : 0.0);
+    fflush(stdout);
+    return mean;
+}
+
+/**
+ * Mean, sample standard deviation and minimum of n repetitions
+ */
+void bench_summary(const double *ns, int n, double *mean, double *sd, double *best) {
+    double sum = 0.0, sum_sq = 0.0;
+
+    *best = ns[0];
+    for (int r = 0; r < n; r++) {
+        sum += ns[r];
+        sum_sq += ns[r] * ns[r];
+        if (ns[r] < *best) {
+            *best = ns[r];
+        }
+    }
+    *mean = sum / n;
+    double var = (n > 1) ? (sum_sq - sum * *mean) / (n - 1) : 0.0;
+    *sd = (var > 0) ? sqrt(var) : 0.0;
+}
+
+/**
+ * Fill the size table: log-uniform between msg_min and msg_max, fixed seed
+ */
+void msg_setup_sizes(void) {
+    unsigned int seed = 12345;
+    double sum = 0.0;
+
+    for (int i = 0; i < MSG_SIZES; i++) {
+        double u = (double)rand_r(&seed) / RAND_MAX;
+        msg_size[i] = (uint32_t)(msg_min * pow((double)msg_max / msg_min, u));
+        if (msg_size[i] > msg_max) {
+            msg_size[i] = (uint32_t)msg_max;
+        }
+        sum += msg_size[i];
+    }
+    msg_mean = sum / MSG_SIZES;
+}
+
+/**
+ * Slots in the FIFO backends for the current one, from the same ring_bytes:
+ * fixed slots hold the largest message, pointer slots the mean one
+ */
+int msg_slots(void) {
+    size_t per_slot = (msg_backend == MSG_FIXED) ? msg_max : (size_t)msg_mean;
+    int slots = (int)(ring_bytes / per_slot);
+    return (slots > 0) ? slots : 1;
+}
+
+/**
+ * Send one message of len bytes through the current backend
+ */
+void msg_send(const unsigned char *src, uint32_t len) {
+    msg_ref ref;
+
+    if (msg_backend == MSG_BYTE_RING) {
+        byte_ring_put(&msg_ring, src, len);
+    } else if (msg_backend == MSG_FIXED) {
+        // Copy into the slot the FIFO is about to fill, under its lock
+        msg_fifo_begin_put(&msg_queue);
+        ref.data = msg_slab + msg_fifo_slot(&msg_queue, msg_queue.in) * msg_max;
+        ref.len = len;
+        memcpy(ref.data, src, len);
+        msg_fifo_push_locked(&msg_queue, ref);
+        msg_fifo_end_put(&msg_queue);
+    } else {
+        ref.data = (unsigned char *)malloc(len);
+        ref.len = len;
+        memcpy(ref.data, src, len);
+        msg_fifo_put(&msg_queue, ref);
+    }
+}
+
+/**
+ * Receive the next message into dst (msg_max bytes); returns its length
+ */
+uint32_t msg_receive(unsigned char *dst) {
+    msg_ref ref;
+
+    if (msg_backend == MSG_BYTE_RING) {
+        return (uint32_t)byte_ring_take(&msg_ring, dst, msg_max);
+    }
+    if (msg_backend == MSG_FIXED) {
+        // Copy out before the slot is released to the sender
+        msg_fifo_begin_take(&msg_queue);
+        ref = msg_fifo_pop_locked(&msg_queue, NULL);
+        memcpy(dst, ref.data, ref.len);
+        msg_fifo_end_take(&msg_queue);
+        return ref.len;
+    }
+    ref = msg_fifo_take(&msg_queue, NULL);
+    memcpy(dst, ref.data, ref.len);
+    free(ref.data);
+    return ref.len;
+}
+
+/**
+ * Message benchmark thread: send, receive, or both, checking every length
+ */
+void *msg_worker(void *param) {
+    bench_thread *bt = (bench_thread *)param;
+    unsigned char *buf = (unsigned char *)malloc(msg_max);
+    long errors = 0;
+
+    if (bt->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(bt->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    memset(buf, 0x5a, msg_max);
+    pthread_barrier_wait(bt->start);
+    bt->t_start = now_ns();
+
+    for (long i = 0; i < bt->iters; i++) {
+        uint32_t len = msg_size[i % MSG_SIZES];
+        if (bt->role != BENCH_TAKE) {
+            msg_send(buf, len);
+        }
+        if (bt->role != BENCH_PUT && msg_receive(buf) != len) {
+            errors++;
+        }
+    }
+    bt->t_end = now_ns();
+    __atomic_fetch_add(&msg_errors, errors, __ATOMIC_RELAXED);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * One repetition of a message case: returns wall-clock ns per message
+ */
+double msg_once(int backend, int threads, const int *roles, long msgs) {
+    pthread_t tids[threads];
+    bench_thread bt[threads];
+    pthread_barrier_t start;
+
+    msg_backend = backend;
+    if (backend == MSG_BYTE_RING) {
+        byte_ring_init(&msg_ring, ring_bytes);
+    } else {
+        msg_fifo_init(&msg_queue, msg_slots());
+        if (backend == MSG_FIXED) {
+            msg_slab = (unsigned char *)malloc((size_t)msg_slots() * msg_max);
+        }
+    }
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        bt[t].cpu = (bench_cpus > 1) ? t % bench_cpus : -1;
+        bt[t].slot = t;
+        bt[t].role = roles[t];
+        bt[t].iters = msgs;
+        bt[t].start = &start;
+        pthread_create(&tids[t], NULL, msg_worker, &bt[t]);
+    }
+    pthread_barrier_wait(&start);
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    long wall = bench_wall(bt, threads);
+    pthread_barrier_destroy(&start);
+    if (backend == MSG_BYTE_RING) {
+        byte_ring_destroy(&msg_ring);
+    } else {
+        msg_fifo_destroy(&msg_queue);
+        free(msg_slab);
+        msg_slab = NULL;
+    }
+    return (double)wall / msgs;
+}
+
+/**
+ * Run one message case and report ns and MB/s per message, plus how many
+ * messages the backend's storage holds
+ */
+void msg_case(const char *name, int backend, int threads, const int *roles, long msgs) {
+    double ns[bench_reps];
+    double mean, sd, best;
+    char holds[32];
+
+    msg_once(backend, threads, roles, msgs);  // warmup
+    for (int r = 0; r < bench_reps; r++) {
+        ns[r] = msg_once(backend, threads, roles, msgs);
+    }
+    bench_summary(ns, bench_reps, &mean, &sd, &best);
+    if (backend == MSG_BYTE_RING) {
+        snprintf(holds, sizeof(holds), "~%.0f msgs",
+                 (double)ring_bytes / byte_ring_record((size_t)msg_mean));
+    } else {
+        snprintf(holds, sizeof(holds), "%d msgs", msg_slots());
+    }
+    printf("%-22s %9.1f ns/msg +-%5.1f%%  min %9.1f  %8.0f MB/s  holds %s\n",
+           name, mean, mean > 0 ? 100.0 * sd / mean : 0.0, best,
+           mean > 0 ? msg_mean * 1e3 / mean : 0.0, holds);
+    fflush(stdout);
+}
+
+/**
+ * Payloads in flight: what fits in ring_bytes of byte ring. The handle ring
+ * is sized to hold as many handles, so both backends have the same depth
+ */
+int payload_slots(void) {
+    int slots = (int)(ring_bytes / byte_ring_record(payload_size));
+    return (slots > 0) ? slots : 1;
+}
+
+/**
+ * Payload thread: the sender writes every cache line of each payload and
+ * the receiver reads every cache line, copying or in place
+ */
+void *payload_worker(void *param) {
+    bench_thread *bt = (bench_thread *)param;
+    unsigned char *buf = (unsigned char *)malloc(payload_size);
+    payload_cache cache;
+    long errors = 0;
+
+    memset(&cache, 0, sizeof(cache));
+    if (bt->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(bt->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    pthread_barrier_wait(bt->start);
+    bt->t_start = now_ns();
+
+    for (long i = 0; i < bt->iters; i++) {
+        unsigned char fill = (unsigned char)i;
+        unsigned char *data = buf;
+        if (bt->role == BENCH_PUT) {
+            if (payload_backend == PAYLOAD_COPY) {
+                memset(buf, fill, payload_size);
+                byte_ring_put(&msg_ring, buf, payload_size);
+            } else {
+                int h = payload_pool_alloc(&pool, &cache);
+                memset(payload_pool_data(&pool, h), fill, payload_size);
+                byte_ring_put(&msg_ring, &h, sizeof(h));
+            }
+            continue;
+        }
+        int h = -1;
+        if (payload_backend == PAYLOAD_COPY) {
+            byte_ring_take(&msg_ring, buf, payload_size);
+        } else {
+            byte_ring_take(&msg_ring, &h, sizeof(h));
+            data = payload_pool_data(&pool, h);
+        }
+        int bad = (data[payload_size - 1] != fill);
+        for (size_t b = 0; b < payload_size; b += 64) {
+            bad |= (data[b] != fill);
+        }
+        errors += bad;
+        if (h >= 0) {
+            payload_pool_release(&pool, &cache, h, 0);
+        }
+    }
+    bt->t_end = now_ns();
+    if (payload_backend == PAYLOAD_HANDLE) {
+        payload_pool_flush(&pool, &cache);
+    }
+    __atomic_fetch_add(&msg_errors, errors, __ATOMIC_RELAXED);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * One repetition of a payload case: returns wall-clock ns per payload
+ */
+double payload_once(int backend, long msgs) {
+    pthread_t tids[2];
+    bench_thread bt[2];
+    pthread_barrier_t start;
+
+    payload_backend = backend;
+    if (backend == PAYLOAD_COPY) {
+        byte_ring_init(&msg_ring, ring_bytes);
+    } else {
+        byte_ring_init(&msg_ring, payload_slots() * byte_ring_record(sizeof(int)));
+        payload_pool_init(&pool, payload_pool_min(payload_slots(), 2), payload_size);
+    }
+    pthread_barrier_init(&start, NULL, 3);
+    for (int t = 0; t < 2; t++) {
+        bt[t].cpu = (bench_cpus > 1) ? t % bench_cpus : -1;
+        bt[t].slot = t;
+        bt[t].role = t ? BENCH_TAKE : BENCH_PUT;
+        bt[t].iters = msgs;
+        bt[t].start = &start;
+        pthread_create(&tids[t], NULL, payload_worker, &bt[t]);
+    }
+    pthread_barrier_wait(&start);
+    for (int t = 0; t < 2; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    long wall = bench_wall(bt, 2);
+    pthread_barrier_destroy(&start);
+    byte_ring_destroy(&msg_ring);
+    if (backend == PAYLOAD_HANDLE) {
+        payload_pool_destroy(&pool);
+    }
+    return (double)wall / msgs;
+}
+
+/**
+ * Run one payload case and print its row; returns the mean ns per payload
+ */
+double payload_case(int backend, long msgs) {
+    double ns[bench_reps];
+    double mean, sd, best;
+    char name[32];
+
+    payload_once(backend, msgs);  // warmup
+    for (int r = 0; r < bench_reps; r++) {
+        ns[r] = payload_once(backend, msgs);
+    }
+    bench_summary(ns, bench_reps, &mean, &sd, &best);
+    snprintf(name, sizeof(name), "%s %zu B", backend == PAYLOAD_COPY ? "copy" : "handle",
+             payload_size);
+    printf("%-22s %9.1f ns/msg +-%5.1f%%  min %9.1f  %8.0f MB/s",
+           name, mean, mean > 0 ? 100.0 * sd / mean : 0.0, best,
+           mean > 0 ? payload_size * 1e3 / mean : 0.0);
+    fflush(stdout);
+    return mean;
+}
+
+/**
+ * Generate n items' value, priority and timestamp; returns ns per item
+ */
+double gen_once(int kind, long n) {
+    unsigned int seed = 1;
+    prng rng;
+    item_batch batch;
+    struct timeval tv;
+    long sum = 0;
+
+    prng_seed(&rng, 1);
+    batch.next = GEN_BATCH;
+    item_clock_source = (kind == GEN_BATCH_TSC) ? ITEM_CLOCK_TSC : ITEM_CLOCK_GETTIMEOFDAY;
+    long t0 = now_ns();
+    for (long i = 0; i < n; i++) {
+        int value, priority;
+        if (kind == GEN_LIBC) {
+            value = rand_r(&seed) % 1000 + 1;
+            priority = (rand_r(&seed) % 100 < 25) ? 1 : 0;
+            gettimeofday(&tv, NULL);
+        } else {
+            if (batch.next == GEN_BATCH) {
+                fill_batch(&rng, &batch);
+            }
+            value = batch.value[batch.next];
+            priority = batch.priority[batch.next++];
+            item_clock(&tv);
+        }
+        sum += value + priority + tv.tv_usec;
+    }
+    long wall = now_ns() - t0;
+    gen_sink = sum;
+    item_clock_source = ITEM_CLOCK_GETTIMEOFDAY;
+    return (double)wall / n;
+}
+
+/**
+ * Run and print one item generation case
+ */
+void gen_case(const char *name, int kind, long n) {
+    double ns[bench_reps];
+    double mean, sd, best;
+
+    gen_once(kind, n);  // warmup
+    for (int r = 0; r < bench_reps; r++) {
+        ns[r] = gen_once(kind, n);
+    }
+    bench_summary(ns, bench_reps, &mean, &sd, &best);
+    printf("%-22s %9.1f ns/item +-%5.1f%%  min %9.1f  %12.0f items/s\n",
+           name, mean, mean > 0 ? 100.0 * sd / mean : 0.0, best, mean > 0 ? 1e9 / mean : 0.0);
+    fflush(stdout);
+}
+
+/**
+ * Main function
+ */
+int main(int argc, char *argv[]) {
+    const char *value;
+
+    for (int l = 0; l < MAX_LEVELS; l++) {
+        level_weight[l] = 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if ((value = option_value(argv[i], "--reps")) != NULL) {
+            bench_reps = atoi(value);
+        } else if ((value = option_value(argv[i], "--iters")) != NULL) {
+            bench_iters = atol(value);
+        } else if ((value = option_value(argv[i], "--threads")) != NULL) {
+            bench_max_threads = atoi(value);
+        } else if ((value = option_value(argv[i], "--capacity")) != NULL) {
+            bench_capacity = atoi(value);
+        } else if ((value = option_value(argv[i], "--msg-min")) != NULL) {
+            msg_min = (size_t)atol(value);
+        } else if ((value = option_value(argv[i], "--msg-max")) != NULL) {
+            msg_max = (size_t)atol(value);
+        } else if ((value = option_value(argv[i], "--ring-bytes")) != NULL) {
+            ring_bytes = (size_t)atol(value);
+        } else if (parse_option(argv[i]) != 0 || mode != MODE_QUEUE) {
+            fprintf(stderr, "Error: Invalid option '%s' (queue mode options only)\n", argv[i]);
+            return 1;
+        }
+    }
+    if (aging_ms > 0 && policy != POLICY_PRIORITY) {
+        fprintf(stderr, "Error: --aging-ms needs --policy=priority\n");
+        return 1;
+    }
+    if (bench_reps <= 0 || bench_iters <= 0 || bench_max_threads <= 0 || bench_capacity <= 1) {
+        fprintf(stderr, "Error: --reps, --iters and --threads must be positive, --capacity > 1\n");
+        return 1;
+    }
+    if (msg_min == 0 || msg_max < msg_min || msg_max > UINT32_MAX / 2 ||
+        ring_bytes < byte_ring_record(msg_max)) {
+        fprintf(stderr, "Error: need 0 < --msg-min <= --msg-max, and --ring-bytes of at "
+                "least --msg-max + %d\n", 2 * BYTE_RING_ALIGN);
+        return 1;
+    }
+
+    bench_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    gettimeofday(&bench_epoch, NULL);
+    pthread_mutex_init(&stats_lock, NULL);
+
+    printf("Queue microbenchmarks: policy %s, %d level(s), capacity %d, %d CPU(s), "
+           "%d rep(s) after 1 warmup\n\n", policy_name(), num_levels, bench_capacity,
+           bench_cpus, bench_reps);
+
+    int roles[bench_max_threads > 2 ? bench_max_threads : 2];
+    char name[32];
+
+    bench_stats = (thread_stats **)calloc(bench_max_threads > 2 ? bench_max_threads : 2,
+                                          sizeof(thread_stats *));
+    if (bench_stats == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    roles[0] = BENCH_PAIRS;
+    bench_case("uncontended", 1, roles, bench_iters, bench_capacity, 0);
+    bench_case("uncontended half full", 1, roles, bench_iters, bench_capacity,
+               bench_capacity / 2);
+
+    roles[0] = BENCH_PUT;
+    roles[1] = BENCH_TAKE;
+    bench_case("ping-pong", 2, roles, bench_iters / 10, 1, 0);
+
+    for (int n = 2; n <= bench_max_threads; n *= 2) {
+        for (int t = 0; t < n; t++) {
+            roles[t] = BENCH_PAIRS;
+        }
+        snprintf(name, sizeof(name), "contended x%d", n);
+        bench_case(name, n, roles, bench_iters / n,
+                   bench_capacity > n ? bench_capacity : n, 0);
+    }
+
+    int pow2 = 1;
+    while (pow2 < bench_capacity) {
+        pow2 *= 2;
+    }
+    printf("\nIndex wrap at capacity %d: mask vs %%\n\n", pow2);
+    roles[0] = BENCH_PAIRS;
+    for (int prefill = 0; prefill <= pow2 / 2; prefill += pow2 / 2) {
+        double ns[2];
+        for (bench_modulo = 0; bench_modulo <= 1; bench_modulo++) {
+            snprintf(name, sizeof(name), "%s %s", prefill ? "half full" : "uncontended",
+                     bench_modulo ? "%" : "mask");
+            ns[bench_modulo] = bench_case(name, 1, roles, bench_iters, pow2, prefill);
+        }
+        printf("  mask is %.2fx as fast\n", ns[0] > 0 ? ns[1] / ns[0] : 0.0);
+    }
+    bench_modulo = 0;
+
+    msg_setup_sizes();
+    long msgs = (bench_iters / 10 > 0) ? bench_iters / 10 : 1;
+    static const char *msg_names[] = {"byte ring", "fixed slots", "pointers"};
+
+    printf("\nVariable-length messages: %zu..%zu B log-uniform (mean %.0f B), "
+           "%zu ring bytes, %ld msgs\n\n", msg_min, msg_max, msg_mean, ring_bytes, msgs);
+    for (int b = MSG_BYTE_RING; b <= MSG_POINTER; b++) {
+        roles[0] = BENCH_PAIRS;
+        snprintf(name, sizeof(name), "%s 1 thread", msg_names[b]);
+        msg_case(name, b, 1, roles, msgs);
+        roles[0] = BENCH_PUT;
+        roles[1] = BENCH_TAKE;
+        snprintf(name, sizeof(name), "%s 1:1", msg_names[b]);
+        msg_case(name, b, 2, roles, msgs);
+    }
+
+    printf("\nPayload passing, 1:1, same depth (ring bytes / record size)\n\n");
+    for (payload_size = 64; payload_size <= msg_max; payload_size *= 4) {
+        long n = (long)(bench_iters * 64 / payload_size);  // same bytes per size
+        n = (n < msgs) ? msgs : (n > bench_iters ? bench_iters : n);
+        double copy = payload_case(PAYLOAD_COPY, n);
+        printf("\n");
+        double handle = payload_case(PAYLOAD_HANDLE, n);
+        printf("  %.2fx vs copy\n", handle > 0 ? copy / handle : 0.0);
+    }
+
+    printf("\nItem generation (value, priority, timestamp), one thread\n\n");
+    gen_case("rand_r + gettimeofday", GEN_LIBC, bench_iters);
+    gen_case("batch + gettimeofday", GEN_BATCH_GTOD, bench_iters);
+    if (tsc_calibrate() == 0) {
+        gen_case("batch + tsc", GEN_BATCH_TSC, bench_iters);
+    } else {
+        printf("batch + tsc            n/a (no invariant TSC)\n");
+    }
+    free(bench_stats);
+    if (msg_errors > 0) {
+        fprintf(stderr, "Error: %ld message(s) received with the wrong length or contents\n",
+                msg_errors);
+        return 1;
+    }
+
+    pthread_mutex_destroy(&stats_lock);
+    return 0;
+}
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+"""
+Benchmark regression runner for producer_consumer
+
+Runs each configuration repeatedly with --metrics-format=json. The first
+--warmup runs are discarded. After that it keeps running until the 95%
+confidence interval of the mean is within --ci-target percent of the mean,
+or until --max-runs is reached. It then either saves the results as a
+baseline or compares them against one. The comparison uses Welch's t-test.
+A configuration counts as faster or slower only when the difference is
+significant at 95% and larger than --min-effect percent. Any significant
+regression makes the exit code 1.
+
+Usage:
+    ./bench_runner.py --save-baseline baseline.json          # on the old build
+    ./bench_runner.py --baseline baseline.json               # on the new build
+    ./bench_runner.py --config configs.json --metric p99_latency_s
+
+A config file is a JSON list of {"name": ..., "args": [...]} objects. The args
+are the positional arguments and options passed to the binary.
+"""
+
+import argparse
+import json
+import math
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+# Default configurations: small, medium and contended shapes
+DEFAULT_CONFIGS = [
+    {"name": "queue-1x1-b16", "args": ["1", "1", "16", "--items=50000"]},
+    {"name": "queue-4x4-b8", "args": ["4", "4", "8", "--items=20000"]},
+    {"name": "queue-8x8-b2", "args": ["8", "8", "2", "--items=5000"]},
+    {"name": "edf-4x4-b32", "args": ["4", "4", "32", "--items=20000", "--policy=edf"]},
+    {"name": "pipeline-2x2-b64", "args": ["2", "2", "64", "--items=20000", "--mode=pipeline"]},
+]
+
+# Metrics read from the "totals" block, and whether higher is better
+METRICS = {
+    "throughput": True,
+    "avg_latency_s": False,
+    "p50_latency_s": False,
+    "p99_latency_s": False,
+}
+
+# Two-sided 95% critical values of Student's t for df = 1..30
+T_TABLE = [12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+           2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+           2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042]
+
+
+def t_critical(df):
+    """Two-sided 95% critical value of t with df degrees of freedom."""
+    if df < 1:
+        return float("inf")
+    if df <= len(T_TABLE):
+        return T_TABLE[int(math.floor(df)) - 1]
+    z = 1.959964  # Cornish-Fisher expansion around the normal quantile
+    return z + (z ** 3 + z) / (4 * df) + (5 * z ** 5 + 16 * z ** 3 + 3 * z) / (96 * df ** 2)
+
+
+def ci_half_width(samples):
+    """Half-width of the 95% confidence interval of the mean."""
+    if len(samples) < 2:
+        return float("inf")
+    return t_critical(len(samples) - 1) * statistics.stdev(samples) / math.sqrt(len(samples))
+
+
+def run_once(binary, args, metric):
+    """Run the binary once and return the chosen metric from its JSON output."""
+    fd, path = tempfile.mkstemp(suffix=".json")
+    os.close(fd)
+    try:
+        cmd = [binary] + args + ["--quiet", "--metrics-format=json", "--metrics-out=" + path]
+        subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+        with open(path) as f:
+            return json.load(f)["totals"][metric]
+    finally:
+        os.unlink(path)
+
+
+def measure(binary, config, opts):
+    """Warm up, then repeat until the CI is tight enough or max_runs is hit."""
+    for _ in range(opts.warmup):
+        run_once(binary, config["args"], opts.metric)
+    samples = []
+    while len(samples) < opts.max_runs:
+        samples.append(run_once(binary, config["args"], opts.metric))
+        if len(samples) < opts.min_runs:
+            continue
+        mean = statistics.mean(samples)
+        if mean != 0 and ci_half_width(samples) / abs(mean) * 100 <= opts.ci_target:
+            break
+    mean = statistics.mean(samples)
+    return {
+        "metric": opts.metric,
+        "mean": mean,
+        "stdev": statistics.stdev(samples) if len(samples) > 1 else 0.0,
+        "ci95": ci_half_width(samples),
+        "runs": len(samples),
+        "samples": samples,
+    }
+
+
+def compare(new, old, higher_is_better, min_effect):
+    """Welch's t-test: return ("faster" | "slower" | "same", change %)."""
+    change = (new["mean"] - old["mean"]) / old["mean"] * 100 if old["mean"] else 0.0
+    var_new = new["stdev"] ** 2 / new["runs"]
+    var_old = old["stdev"] ** 2 / old["runs"]
+    if var_new + var_old == 0:
+        significant = new["mean"] != old["mean"]
+    else:
+        t = (new["mean"] - old["mean"]) / math.sqrt(var_new + var_old)
+        df = (var_new + var_old) ** 2 / (var_new ** 2 / (new["runs"] - 1) +
+                                         var_old ** 2 / (old["runs"] - 1))
+        significant = abs(t) > t_critical(df)
+    if not significant or abs(change) < min_effect:
+        return "same", change
+    improved = (change > 0) == higher_is_better
+    return ("faster" if improved else "slower"), change
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Statistical benchmark regression runner")
+    parser.add_argument("--binary", default="./producer_consumer")
+    parser.add_argument("--config", help="JSON list of {name, args} (default: built-in set)")
+    parser.add_argument("--metric", default="throughput", choices=sorted(METRICS))
+    parser.add_argument("--warmup", type=int, default=2, help="discarded runs per config")
+    parser.add_argument("--min-runs", type=int, default=5)
+    parser.add_argument("--max-runs", type=int, default=30)
+    parser.add_argument("--ci-target", type=float, default=2.0,
+                        help="stop once the 95%% CI half-width is within this %% of the mean")
+    parser.add_argument("--min-effect", type=float, default=3.0,
+                        help="ignore significant changes smaller than this %%")
+    parser.add_argument("--baseline", help="compare against this baseline file")
+    parser.add_argument("--save-baseline", help="write the results to this baseline file")
+    opts = parser.parse_args()
+    if opts.min_runs < 2 or opts.max_runs < opts.min_runs:
+        parser.error("need 2 <= --min-runs <= --max-runs")
+
+    configs = DEFAULT_CONFIGS
+    if opts.config:
+        with open(opts.config) as f:
+            configs = json.load(f)
+    baseline = {}
+    if opts.baseline:
+        with open(opts.baseline) as f:
+            baseline = json.load(f)["configs"]
+
+    results = {}
+    regressions = 0
+    print("%-20s %14s %9s %5s  %s" % ("config", opts.metric, "ci95", "runs", "vs baseline"))
+    for config in configs:
+        r = measure(opts.binary, config, opts)
+        results[config["name"]] = r
+        verdict = ""
+        old = baseline.get(config["name"])
+        if old is not None and old["metric"] == opts.metric:
+            outcome, change = compare(r, old, METRICS[opts.metric], opts.min_effect)
+            verdict = "%s (%+.1f%%)" % (outcome, change)
+            regressions += (outcome == "slower")
+        elif opts.baseline:
+            verdict = "no baseline"
+        print("%-20s %14.6g %8.1f%% %5d  %s" % (
+            config["name"], r["mean"], r["ci95"] / abs(r["mean"]) * 100 if r["mean"] else 0.0,
+            r["runs"], verdict))
+        sys.stdout.flush()
+
+    if opts.save_baseline:
+        with open(opts.save_baseline, "w") as f:
+            json.dump({"binary": opts.binary, "configs": results}, f, indent=2)
+        print("Baseline written to %s" % opts.save_baseline)
+    if regressions:
+        print("%d configuration(s) significantly slower than the baseline" % regressions)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
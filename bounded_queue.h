@@ -0,0 +1,206 @@
+/*
+ * bounded_queue.h - generic bounded blocking queue (header only)
+ *
+ * The bounded buffer of producer_consumer.c without its item type, globals
+ * or main(). A queue type is declared with BQ_TYPE(name, T) and its
+ * functions are generated with one of
+ *
+ *   BQ_DEFINE_FIFO(name, T, CAPACITY, WAIT, STATS)
+ *   BQ_DEFINE_PRIORITY(name, T, CAPACITY, PRIORITY, WAIT, STATS)
+ *
+ * The parameters are compile-time policies:
+ *   T         payload type, copied in and out by assignment. Payloads that
+ *             own memory or other resources should be queued by pointer or
+ *             handle, so the queue never copies the resource itself.
+ *   CAPACITY  0 = chosen at name_init(); a constant fixes it at compile time.
+ *             A power-of-two capacity, constant or chosen at init, wraps
+ *             indices with a mask instead of a division.
+ *   PRIORITY  int f(const T *value, const void *ctx), larger = more urgent.
+ *             name_take() returns the most urgent value, the oldest among
+ *             equals. ctx is passed through (e.g. the time, for aging).
+ *   WAIT      void f(sem_t *sem, int kind) that must sem_wait(sem), e.g. to
+ *             measure blocking; kind is BQ_WAIT_EMPTY, _FULL or _MUTEX.
+ *             BQ_SEM_WAIT is a plain sem_wait.
+ *   STATS     1 = count puts, takes and the high-water mark, 0 = no counters.
+ *
+ * Synchronization is the classic pattern: counting semaphores empty (free
+ * slots) and full (stored values) plus a binary semaphore mutex around the
+ * ring. name_put() and name_take() are the whole operation. The begin/end
+ * and _locked pieces let a caller run its own code inside the critical
+ * section, or keep values in its own storage under the same semaphores.
+ *
+ * in and out are free-running 64-bit sequence numbers, never wrapped; the
+ * slot of sequence s is name_slot(q, s). With a power-of-two capacity that
+ * is s & (capacity - 1), otherwise s % capacity.
+ */
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* What a WAIT function is waiting on */
+#define BQ_WAIT_EMPTY 0  // a free slot (put)
+#define BQ_WAIT_FULL 1   // a stored value (take)
+#define BQ_WAIT_MUTEX 2  // the critical section
+
+#define BQ_SEM_WAIT(sem, kind) sem_wait(sem)
+#define BQ_NO_PRIORITY(value, ctx) 0
+
+/* Queue type: a ring of T with its semaphores */
+#define BQ_TYPE(name, T)                                                        \
+typedef struct {                                                                \
+    T *slots;                                                                   \
+    int capacity;                                                               \
+    int masked;     /* capacity is a power of two: wrap with a mask, not % */   \
+    uint64_t in;    /* tail: sequence of the next value put */                  \
+    uint64_t out;   /* head: sequence of the oldest value */                    \
+    int count;      /* values in the ring (atomic stores, see name##_size) */   \
+    sem_t mutex;                                                                \
+    sem_t empty;                                                                \
+    sem_t full;                                                                 \
+    long puts;        /* STATS only */                                          \
+    long takes;                                                                 \
+    int high_water;                                                             \
+} name;
+
+#define BQ_DEFINE_FIFO(name, T, CAPACITY, WAIT, STATS)                          \
+    BQ_DEFINE_(name, T, CAPACITY, 0, BQ_NO_PRIORITY, WAIT, STATS)
+
+#define BQ_DEFINE_PRIORITY(name, T, CAPACITY, PRIORITY, WAIT, STATS)            \
+    BQ_DEFINE_(name, T, CAPACITY, 1, PRIORITY, WAIT, STATS)
+
+#define BQ_DEFINE_(name, T, CAPACITY, SCAN, PRIORITY, WAIT, STATS)              \
+                                                                                \
+/* Slots in the ring: a compile-time constant unless CAPACITY is 0 */          \
+static inline int name##_capacity(const name *q) {                              \
+    return (CAPACITY) ? (CAPACITY) : q->capacity;                               \
+}                                                                               \
+                                                                                \
+/* Slot of sequence seq: a mask for power-of-two capacities */                 \
+static inline uint64_t name##_slot(const name *q, uint64_t seq) {               \
+    if ((CAPACITY) > 0 && ((CAPACITY) & ((CAPACITY) - 1)) == 0) {               \
+        return seq & (uint64_t)((CAPACITY) - 1);                                \
+    }                                                                           \
+    if (q->masked) {                                                            \
+        return seq & (uint64_t)(q->capacity - 1);                               \
+    }                                                                           \
+    return seq % (uint64_t)name##_capacity(q);                                  \
+}                                                                               \
+                                                                                \
+/* Allocate the ring; returns 0, or -1 if out of memory or capacity < 1 */     \
+static inline int name##_init(name *q, int capacity) {                          \
+    q->capacity = (CAPACITY) ? (CAPACITY) : capacity;                           \
+    if (q->capacity < 1) {                                                      \
+        return -1;                                                              \
+    }                                                                           \
+    q->slots = (T *)malloc((size_t)q->capacity * sizeof(T));                    \
+    if (q->slots == NULL) {                                                     \
+        return -1;                                                              \
+    }                                                                           \
+    q->masked = ((q->capacity & (q->capacity - 1)) == 0);                       \
+    q->in = 0;                                                                  \
+    q->out = 0;                                                                 \
+    q->count = 0;                                                               \
+    q->puts = 0;                                                                \
+    q->takes = 0;                                                               \
+    q->high_water = 0;                                                          \
+    sem_init(&q->mutex, 0, 1);                                                  \
+    sem_init(&q->empty, 0, q->capacity);                                        \
+    sem_init(&q->full, 0, 0);                                                   \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+static inline void name##_destroy(name *q) {                                    \
+    free(q->slots);                                                             \
+    q->slots = NULL;                                                            \
+    sem_destroy(&q->mutex);                                                     \
+    sem_destroy(&q->empty);                                                     \
+    sem_destroy(&q->full);                                                      \
+}                                                                               \
+                                                                                \
+/* Wait for a free slot, then enter the critical section */                    \
+static inline void name##_begin_put(name *q) {                                  \
+    WAIT(&q->empty, BQ_WAIT_EMPTY);                                             \
+    WAIT(&q->mutex, BQ_WAIT_MUTEX);                                             \
+}                                                                               \
+                                                                                \
+/* Leave the critical section and signal one stored value */                   \
+static inline void name##_end_put(name *q) {                                    \
+    sem_post(&q->mutex);                                                        \
+    sem_post(&q->full);                                                         \
+}                                                                               \
+                                                                                \
+/* Wait for a stored value, then enter the critical section */                 \
+static inline void name##_begin_take(name *q) {                                 \
+    WAIT(&q->full, BQ_WAIT_FULL);                                               \
+    WAIT(&q->mutex, BQ_WAIT_MUTEX);                                             \
+}                                                                               \
+                                                                                \
+/* Leave the critical section and signal one free slot */                      \
+static inline void name##_end_take(name *q) {                                   \
+    sem_post(&q->mutex);                                                        \
+    sem_post(&q->empty);                                                        \
+}                                                                               \
+                                                                                \
+/* Append to the ring (between begin_put and end_put) */                       \
+static inline void name##_push_locked(name *q, T value) {                       \
+    q->slots[name##_slot(q, q->in++)] = value;                                  \
+    __atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELAXED);                \
+    if (STATS) {                                                                \
+        q->puts++;                                                              \
+        if (q->count > q->high_water) {                                         \
+            q->high_water = q->count;                                           \
+        }                                                                       \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+/* Remove the next value (between begin_take and end_take): the oldest, or    \
+ * with a priority the most urgent by a scan, closing the gap by shifting */   \
+static inline T name##_pop_locked(name *q, const void *ctx) {                   \
+    uint64_t best = q->out;                                                     \
+    (void)ctx;                                                                  \
+    if (SCAN) {                                                                 \
+        int best_priority = PRIORITY(&q->slots[name##_slot(q, best)], ctx);     \
+        for (uint64_t seq = q->out + 1; seq != q->in; seq++) {                  \
+            int priority = PRIORITY(&q->slots[name##_slot(q, seq)], ctx);       \
+            if (priority > best_priority) {                                     \
+                best_priority = priority;                                       \
+                best = seq;                                                     \
+            }                                                                   \
+        }                                                                       \
+    }                                                                           \
+    T value = q->slots[name##_slot(q, best)];                                   \
+    for (; best != q->out; best--) {                                            \
+        q->slots[name##_slot(q, best)] = q->slots[name##_slot(q, best - 1)];    \
+    }                                                                           \
+    q->out++;                                                                   \
+    __atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELAXED);                \
+    if (STATS) {                                                                \
+        q->takes++;                                                             \
+    }                                                                           \
+    return value;                                                               \
+}                                                                               \
+                                                                                \
+/* Blocking put: waits while the queue is full */                              \
+static inline void name##_put(name *q, T value) {                               \
+    name##_begin_put(q);                                                        \
+    name##_push_locked(q, value);                                               \
+    name##_end_put(q);                                                          \
+}                                                                               \
+                                                                                \
+/* Blocking take: waits while the queue is empty */                            \
+static inline T name##_take(name *q, const void *ctx) {                         \
+    name##_begin_take(q);                                                       \
+    T value = name##_pop_locked(q, ctx);                                        \
+    name##_end_take(q);                                                         \
+    return value;                                                               \
+}                                                                               \
+                                                                                \
+/* Values in the ring right now (a racy snapshot outside the lock) */          \
+static inline int name##_size(const name *q) {                                  \
+    return __atomic_load_n(&q->count, __ATOMIC_RELAXED);                        \
+}
+
+#endif /* BOUNDED_QUEUE_H */
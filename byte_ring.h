@@ -0,0 +1,192 @@
+/*
+ * byte_ring.h - bounded ring of variable-length messages (header only)
+ *
+ * bounded_queue.h stores one fixed-size T per slot, so messages that range
+ * from a few bytes to tens of KB either need slots sized for the largest
+ * one or a side allocation per message. This ring stores the bytes
+ * themselves, contiguously, as records:
+ *
+ *   | length (4) | reserved (4) | payload, padded to a multiple of 8 |
+ *
+ * Records are 8-byte aligned and never split. When a record does not fit
+ * between the write position and the end of the ring, the rest of the ring
+ * is filled with a padding record and the message is written at offset 0.
+ * Capacity and backpressure are in bytes: byte_ring_put() blocks until
+ * the record (and any padding in front of it) fits, so a full ring holds
+ * many small messages or a few large ones.
+ *
+ * Any number of producers and consumers may share a ring. The critical
+ * section is one memcpy; waiting threads sleep on condition variables.
+ * A message of up to byte_ring_max_message() bytes always fits once the
+ * ring has drained, but a large message can wait behind a steady stream
+ * of small ones (there is no FIFO among waiting producers).
+ */
+#ifndef BYTE_RING_H
+#define BYTE_RING_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTE_RING_ALIGN 8
+#define BYTE_RING_HEADER 8            // length + reserved, keeps payloads aligned
+#define BYTE_RING_PAD 0xffffffffu     // length of a padding record (skip to offset 0)
+
+typedef struct {
+    unsigned char *data;
+    size_t capacity;  // bytes, a multiple of BYTE_RING_ALIGN
+    size_t head;      // offset of the oldest record
+    size_t tail;      // offset where the next record goes
+    size_t used;      // bytes held by records and padding
+    long count;       // messages in the ring
+    int closed;       // no more puts; takes drain what is left
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    size_t high_water;  // most bytes ever used
+    long waits_full;    // puts that had to wait for space
+} byte_ring;
+
+/* Bytes a message of len bytes occupies, header included */
+static inline size_t byte_ring_record(size_t len) {
+    return BYTE_RING_HEADER + ((len + BYTE_RING_ALIGN - 1) & ~(size_t)(BYTE_RING_ALIGN - 1));
+}
+
+/* Largest message the ring can hold */
+static inline size_t byte_ring_max_message(const byte_ring *r) {
+    return r->capacity - BYTE_RING_HEADER;
+}
+
+/* Allocate capacity bytes (rounded down to the alignment); returns 0, or -1
+ * if out of memory or too small for one header and one aligned payload */
+static inline int byte_ring_init(byte_ring *r, size_t capacity) {
+    r->capacity = capacity & ~(size_t)(BYTE_RING_ALIGN - 1);
+    if (r->capacity < BYTE_RING_HEADER + BYTE_RING_ALIGN) {
+        return -1;
+    }
+    r->data = (unsigned char *)aligned_alloc(BYTE_RING_ALIGN, r->capacity);
+    if (r->data == NULL) {
+        return -1;
+    }
+    r->head = 0;
+    r->tail = 0;
+    r->used = 0;
+    r->count = 0;
+    r->closed = 0;
+    r->high_water = 0;
+    r->waits_full = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->not_empty, NULL);
+    pthread_cond_init(&r->not_full, NULL);
+    return 0;
+}
+
+static inline void byte_ring_destroy(byte_ring *r) {
+    free(r->data);
+    r->data = NULL;
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->not_empty);
+    pthread_cond_destroy(&r->not_full);
+}
+
+/* Bytes a record of rec bytes needs at the current tail: the record itself,
+ * plus padding up to the end of the ring if it has to go to offset 0 */
+static inline size_t byte_ring_need(const byte_ring *r, size_t rec) {
+    size_t to_end = r->capacity - r->tail;
+    return (rec <= to_end) ? rec : to_end + rec;
+}
+
+/* Copy len bytes in as one message, waiting for space. Returns 0, or -1 if
+ * the message is larger than byte_ring_max_message() or the ring is closed. */
+static inline int byte_ring_put(byte_ring *r, const void *msg, size_t len) {
+    size_t rec = byte_ring_record(len);
+    if (rec > r->capacity) {
+        return -1;
+    }
+    pthread_mutex_lock(&r->lock);
+    if (r->used == 0) {
+        r->head = r->tail = 0;  // empty: restart at 0, so any record fits
+    }
+    if (!r->closed && byte_ring_need(r, rec) > r->capacity - r->used) {
+        r->waits_full++;
+        do {
+            pthread_cond_wait(&r->not_full, &r->lock);
+            if (r->used == 0) {
+                r->head = r->tail = 0;
+            }
+        } while (!r->closed && byte_ring_need(r, rec) > r->capacity - r->used);
+    }
+    if (r->closed) {
+        pthread_mutex_unlock(&r->lock);
+        return -1;
+    }
+
+    if (rec > r->capacity - r->tail) {
+        // Too little room before the end: pad it out and wrap
+        uint32_t pad = BYTE_RING_PAD;
+        memcpy(r->data + r->tail, &pad, sizeof(pad));
+        r->used += r->capacity - r->tail;
+        r->tail = 0;
+    }
+    uint32_t header[2] = {(uint32_t)len, 0};
+    memcpy(r->data + r->tail, header, sizeof(header));
+    memcpy(r->data + r->tail + BYTE_RING_HEADER, msg, len);
+    r->tail += rec;
+    if (r->tail == r->capacity) {
+        r->tail = 0;
+    }
+    r->used += rec;
+    r->count++;
+    if (r->used > r->high_water) {
+        r->high_water = r->used;
+    }
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+/* Remove the oldest message, copying up to max bytes of it into buf, and
+ * waiting while the ring is empty. Returns the message's full length, or -1
+ * once the ring is closed and empty. */
+static inline long byte_ring_take(byte_ring *r, void *buf, size_t max) {
+    pthread_mutex_lock(&r->lock);
+    while (r->count == 0 && !r->closed) {
+        pthread_cond_wait(&r->not_empty, &r->lock);
+    }
+    if (r->count == 0) {
+        pthread_mutex_unlock(&r->lock);
+        return -1;
+    }
+
+    uint32_t len;
+    memcpy(&len, r->data + r->head, sizeof(len));
+    if (len == BYTE_RING_PAD) {
+        r->used -= r->capacity - r->head;
+        r->head = 0;
+        memcpy(&len, r->data, sizeof(len));
+    }
+    memcpy(buf, r->data + r->head + BYTE_RING_HEADER, (len < max) ? len : max);
+    size_t rec = byte_ring_record(len);
+    r->head += rec;
+    if (r->head == r->capacity) {
+        r->head = 0;
+    }
+    r->used -= rec;
+    r->count--;
+    // Waiting producers need different amounts of space: wake them all
+    pthread_cond_broadcast(&r->not_full);
+    pthread_mutex_unlock(&r->lock);
+    return (long)len;
+}
+
+/* Stop accepting messages and wake every waiting thread */
+static inline void byte_ring_close(byte_ring *r) {
+    pthread_mutex_lock(&r->lock);
+    r->closed = 1;
+    pthread_cond_broadcast(&r->not_empty);
+    pthread_cond_broadcast(&r->not_full);
+    pthread_mutex_unlock(&r->lock);
+}
+
+#endif /* BYTE_RING_H */
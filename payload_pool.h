@@ -0,0 +1,150 @@
+/*
+ * payload_pool.h - fixed-size payload buffers passed by handle (header only)
+ *
+ * Large payloads should not be copied through a queue. A producer takes a
+ * buffer from the pool, fills it in place and queues only its handle (an
+ * int); the consumer reads the buffer in place and gives it back. The
+ * queue moves a few bytes however large the payload is.
+ *
+ * Every thread keeps a small cache of free handles (a payload_cache it
+ * owns), so most allocations and releases touch no shared state. A thread
+ * refills its empty cache from the shared free list, or spills half of a
+ * full one back to it, PAYLOAD_BATCH handles per lock acquisition. In a
+ * producer/consumer split the buffers flow one way: consumers' caches fill
+ * up and spill, producers' caches run dry and refill.
+ *
+ * An allocation waits while the shared list is empty, so the pool must
+ * hold more buffers than can be in flight plus everything the caches can
+ * hold: queue capacity + threads x (PAYLOAD_CACHE + 1) never waits
+ * (payload_pool_min()). Handles are in [0, count) and stay valid until
+ * payload_pool_destroy().
+ */
+#ifndef PAYLOAD_POOL_H
+#define PAYLOAD_POOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define PAYLOAD_CACHE 16  // free handles a thread can hold
+#define PAYLOAD_BATCH 8   // handles moved per refill or spill
+#define PAYLOAD_ALIGN 64  // buffers start on their own cache line
+
+typedef struct {
+    unsigned char *slab;  // count buffers of stride bytes
+    size_t size;          // usable bytes per buffer
+    size_t stride;        // size rounded up to PAYLOAD_ALIGN
+    int count;
+    int *free_list;       // shared free handles, a stack
+    int free_count;
+    long *released_ns;    // [h]: when h was last released, 0 = never used
+    long waits;           // allocations that found the pool empty
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+} payload_pool;
+
+/* One thread's cache of free handles; only the owning thread touches it */
+typedef struct {
+    int handles[PAYLOAD_CACHE];
+    int count;
+    long allocs;
+    long hits;     // allocations served from the cache
+    long refills;  // allocations that went to the shared list
+    long releases;
+    long spills;   // releases that moved a batch back to the shared list
+} payload_cache;
+
+/* Smallest pool that never blocks: every queued handle, plus every thread
+ * holding a full cache and one buffer in hand */
+static inline int payload_pool_min(int queue_capacity, int threads) {
+    return queue_capacity + threads * (PAYLOAD_CACHE + 1);
+}
+
+/* Allocate count buffers of size bytes; returns 0, or -1 if out of memory */
+static inline int payload_pool_init(payload_pool *p, int count, size_t size) {
+    p->size = size;
+    p->stride = (size + PAYLOAD_ALIGN - 1) & ~(size_t)(PAYLOAD_ALIGN - 1);
+    p->count = count;
+    p->slab = (unsigned char *)aligned_alloc(PAYLOAD_ALIGN, (size_t)count * p->stride);
+    p->free_list = (int *)malloc(count * sizeof(int));
+    p->released_ns = (long *)calloc(count, sizeof(long));
+    if (p->slab == NULL || p->free_list == NULL || p->released_ns == NULL) {
+        free(p->slab);
+        free(p->free_list);
+        free(p->released_ns);
+        return -1;
+    }
+    for (int h = 0; h < count; h++) {
+        p->free_list[h] = count - 1 - h;  // handle 0 on top
+    }
+    p->free_count = count;
+    p->waits = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->available, NULL);
+    return 0;
+}
+
+static inline void payload_pool_destroy(payload_pool *p) {
+    free(p->slab);
+    free(p->free_list);
+    free(p->released_ns);
+    p->slab = NULL;
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->available);
+}
+
+/* The bytes behind handle h */
+static inline unsigned char *payload_pool_data(const payload_pool *p, int h) {
+    return p->slab + (size_t)h * p->stride;
+}
+
+/* Take a free buffer, from the thread's cache when it has one */
+static inline int payload_pool_alloc(payload_pool *p, payload_cache *c) {
+    c->allocs++;
+    if (c->count > 0) {
+        c->hits++;
+        return c->handles[--c->count];
+    }
+    c->refills++;
+    pthread_mutex_lock(&p->lock);
+    if (p->free_count == 0) {
+        p->waits++;
+        do {
+            pthread_cond_wait(&p->available, &p->lock);
+        } while (p->free_count == 0);
+    }
+    while (c->count < PAYLOAD_BATCH && p->free_count > 0) {
+        c->handles[c->count++] = p->free_list[--p->free_count];
+    }
+    pthread_mutex_unlock(&p->lock);
+    return c->handles[--c->count];
+}
+
+/* Move n handles from the top of the cache to the shared list */
+static inline void payload_pool_spill(payload_pool *p, payload_cache *c, int n) {
+    pthread_mutex_lock(&p->lock);
+    while (n-- > 0) {
+        p->free_list[p->free_count++] = c->handles[--c->count];
+    }
+    pthread_cond_broadcast(&p->available);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Give buffer h back; now is stamped for the recycle latency of its next use */
+static inline void payload_pool_release(payload_pool *p, payload_cache *c, int h, long now) {
+    c->releases++;
+    if (c->count == PAYLOAD_CACHE) {
+        c->spills++;
+        payload_pool_spill(p, c, PAYLOAD_BATCH);
+    }
+    p->released_ns[h] = now;
+    c->handles[c->count++] = h;
+}
+
+/* Return every cached handle, e.g. when the thread exits */
+static inline void payload_pool_flush(payload_pool *p, payload_cache *c) {
+    if (c->count > 0) {
+        payload_pool_spill(p, c, c->count);
+    }
+}
+
+#endif /* PAYLOAD_POOL_H */
@@ -1,201 +1,3286 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+#include "bounded_queue.h"
+#include "payload_pool.h"
 
 /* Constants */
 #define ITEMS_PER_PRODUCER 20
 #define POISON_PILL -1
+#define RETIRE_SIGNAL -2  // returned by remove_item() to a consumer that should exit
+#define MAX_LEVELS 64   // priority levels fit one 64-bit occupancy bitmap
+#define HIST_BUCKETS 32  // log2 buckets of microseconds
+#define MAX_STAGES 8     // pipeline stages or broadcast consumer groups
+
+/* What a thread can wait on (blocked-time instrumentation) */
+#define WAIT_EMPTY BQ_WAIT_EMPTY  // producer waiting for a free slot
+#define WAIT_FULL BQ_WAIT_FULL    // consumer waiting for an item
+#define WAIT_MUTEX BQ_WAIT_MUTEX  // either waiting for the critical section
+#define WAIT_RING 3   // sequence ring gate (pipeline/broadcast modes)
+#define WAIT_KINDS 4
+
+/* Per-item tracing (--trace) */
+#define TRACE_ENQUEUE 0  // producer: t0 before insert_item, t1 once inserted
+#define TRACE_DEQUEUE 1  // consumer: t0 before remove, t1 once removed, t2 once consumed
+#define TRACE_RING_DEFAULT 65536  // events kept per thread (oldest overwritten)
+
+/* Hardware/software counters per thread (--perf) */
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_L1D_MISSES 2
+#define PERF_LLC_MISSES 3
+#define PERF_CONTEXT_SWITCHES 4
+#define PERF_EVENTS 5
+
+/* Item generation: values and priorities are drawn GEN_BATCH at a time */
+#define GEN_BATCH 32
+
+/* Where item timestamps come from (--clock) */
+#define ITEM_CLOCK_GETTIMEOFDAY 0  // gettimeofday() per item (default)
+#define ITEM_CLOCK_TSC 1           // rdtsc, calibrated against the wall clock at startup
+
+/* Workload recordings (--record / --replay) */
+#define WORKLOAD_MAGIC "PCWKLD01"
+#define WORKLOAD_VERSION 1
+
+/* Machine-readable metrics (--metrics-format) */
+#define METRICS_SCHEMA_VERSION 1
+#define METRICS_TEXT 0  // text summary only (default)
+#define METRICS_JSON 1  // one nested JSON document
+#define METRICS_CSV 2   // "key,value" rows with dotted keys (same tree as JSON)
+#define METRICS_MAX_DEPTH 8
+
+/* Dequeue policies */
+#define POLICY_PRIORITY 0  // urgent-first scan of the circular buffer (default)
+#define POLICY_EDF 1       // earliest-deadline-first, buffer used as a binary min-heap
+#define POLICY_LEVELS 2    // per-level FIFOs, highest non-empty level found via bitmap
+#define POLICY_DRR 3       // per-level FIFOs served by weighted deficit round robin
+#define POLICY_KEYED 4     // one FIFO lane per consumer, items routed by producer id
+
+/* Open-loop arrival processes (--rate) */
+#define ARRIVAL_POISSON 0   // exponential inter-arrival gaps (default)
+#define ARRIVAL_CONSTANT 1  // evenly spaced
+#define ARRIVAL_BURSTY 2    // Poisson during on-windows, silent during off-windows
+
+/* How a work model samples its per-item costs */
+#define WORK_FIXED 0    // exactly the configured cost
+#define WORK_EXP 1      // exponential with the configured mean
+#define WORK_UNIFORM 2  // uniform on [0, 2 x the configured mean]
+
+/* Run modes */
+#define MODE_QUEUE 0     // producers -> bounded buffer -> consumers (default)
+#define MODE_PIPELINE 1  // producers -> stage 1 -> ... -> stage N over one sequence ring
+#define MODE_BROADCAST 2 // producers -> every consumer group sees every item
 
 /* Buffer item structure */
 typedef struct {
     int value;
-    int priority;  // 0 = normal, 1 = urgent (bonus feature)
+    int priority;  // 0 = normal, 1 = urgent (bonus feature); 0..num_levels-1 in general
     struct timeval timestamp;  // for latency calculation (bonus feature)
+    struct timeval deadline;   // absolute time by which the item should be consumed
+    int producer_id;  // routing key for POLICY_KEYED
+    int seq;          // per-producer sequence number, for ordering checks
+    int payload;      // payload_pool handle (--payload), -1 = none
 } item;
 
-/* Circular buffer */
-item *buffer;
-int buffer_size;
-int in = 0;   // tail index (where producer inserts)
-int out = 0;  // head index (where consumer removes)
+/* Workload recording file: one header, then events sorted by producer and
+ * time. Fixed-width fields in host byte order. */
+typedef struct {
+    char magic[8];         // WORKLOAD_MAGIC
+    uint32_t version;
+    uint32_t producers;    // producers in the recorded run
+    uint64_t count;        // events that follow
+    double duration_s;     // the recorded run's results, to compare a replay against
+    double throughput;
+    double avg_latency_s;
+    double p99_latency_s;
+} workload_header;
+
+typedef struct {
+    int64_t t_ns;          // arrival (scheduled send time) since the start of the run
+    int32_t value;
+    uint32_t size;         // payload bytes
+    uint16_t producer_id;
+    uint16_t priority;
+    uint32_t reserved;
+} workload_event;
+
+/* xoshiro256** generator state, one per producer */
+typedef struct {
+    uint64_t s[4];
+} prng;
+
+/* A producer's pre-drawn item values and priorities */
+typedef struct {
+    int value[GEN_BATCH];
+    int priority[GEN_BATCH];
+    int next;  // next unused entry, GEN_BATCH = refill
+} item_batch;
+
+/* Synthetic per-item cost (--producer-work / --consumer-work) */
+typedef struct {
+    long spin_ns;   // CPU busy time (mean, see dist)
+    long sleep_us;  // blocking delay, like waiting on I/O (mean, see dist)
+    int touch_kb;   // per-thread working set written through once per item
+    int dist;       // WORK_FIXED, WORK_EXP or WORK_UNIFORM
+} work_model;
+
+/* Emits one metrics tree as nested JSON or as flattened CSV rows */
+typedef struct {
+    FILE *f;
+    int json;
+    int depth;
+    int first[METRICS_MAX_DEPTH];        // no member written yet at this depth (JSON)
+    size_t path_len[METRICS_MAX_DEPTH];  // length of path when the object was opened
+    char path[256];                      // dotted key prefix (CSV)
+} metrics_writer;
+
+/* Queue types from bounded_queue.h (functions generated after the prototypes) */
+BQ_TYPE(item_queue, item)  // shared buffer: urgent-first scan, or raw storage
+BQ_TYPE(item_fifo, item)   // plain FIFO
+
+/* Consumer lane (POLICY_KEYED): a private bounded buffer per consumer */
+typedef struct {
+    item_fifo q;
+    long consumed;  // written by the lane's consumer only
+} lane;
+
+/* Histogram of durations: bucket b counts values in [2^(b-1), 2^b) microseconds */
+typedef struct {
+    long count[HIST_BUCKETS];
+} histogram;
+
+/* One traced step of one item (monotonic ns) */
+typedef struct {
+    long t0, t1, t2;
+    long slot_wait_ns;   // blocked on empty (enqueue) or full (dequeue) during the step
+    long mutex_wait_ns;  // blocked on the mutex during the step
+    int producer_id;
+    int seq;
+    short priority;
+    short kind;          // TRACE_ENQUEUE or TRACE_DEQUEUE
+} trace_event;
+
+/* Per-thread counters: written only by the owning thread (relaxed atomic
+ * stores), read by the sampler and autoscaler without taking any lock */
+typedef struct thread_stats {
+    char role;       // 'P' producer, 'C' consumer / stage worker
+    int id;
+    long produced;
+    long consumed;
+    histogram latency;
+    long latency_ns;  // sum of consumed items' latencies
+    int blocked;     // 1 while waiting on a semaphore or the sequence ring
+    long fast_acquires[WAIT_KINDS];  // acquired without waiting
+    long waits[WAIT_KINDS];          // had to block
+    long wait_ns[WAIT_KINDS];        // total time blocked
+    int perf_fd[PERF_EVENTS];      // open counters, -1 if unavailable
+    int perf_valid[PERF_EVENTS];   // perf_count[e] holds a real measurement
+    long perf_count[PERF_EVENTS];  // counts over the thread's main loop
+    long work_items;     // items that went through do_work()
+    long work_ns;        // time spent in do_work()
+    char *work_set;      // touch_kb working set (allocated on first use)
+    uint64_t *seen;      // --verify: one bit per (producer, seq) this thread consumed
+    int *seen_last;      // --verify: last seq this thread saw per producer (-1 = none)
+    long seen_dups;      // consumed twice by this thread
+    long seen_reorders;  // older than an item this thread already saw from that producer
+    long seen_corrupt;   // producer id or seq out of range
+    payload_cache pool_cache;  // --payload: this thread's free buffers
+    histogram recycle;         // --payload: time from a buffer's release to its reuse
+    long recycle_ns;
+    long payload_errors;       // payloads that did not hold what the producer wrote
+    workload_event *recorded;  // --record: this producer's arrivals
+    long recorded_count;
+    long recorded_slots;
+    trace_event *trace;  // per-thread trace ring (NULL unless --trace)
+    long trace_count;    // events ever recorded; ring index is count % trace_ring_size
+    struct thread_stats *next;  // registry list, newest first
+} thread_stats;
+
+/* Totals summed over all thread_stats blocks at one instant */
+typedef struct {
+    long produced;
+    long consumed;
+    histogram latency;
+    long latency_ns;
+    int blocked_producers;
+    int blocked_consumers;
+    long fast_acquires[2][WAIT_KINDS];  // [0] producers, [1] consumers
+    long waits[2][WAIT_KINDS];
+    long wait_ns[2][WAIT_KINDS];
+} stats_snapshot;
+
+/* Shared bounded buffer. POLICY_PRIORITY stores items in queue's ring. The
+ * EDF heap and the sequence ring keep their items in queue.slots themselves,
+ * and every queue-mode policy uses queue's semaphores. */
+item_queue queue;
+item *buffer;  // queue.slots
+int buffer_size;
+long buffer_mask = -1; // buffer_size - 1 if it is a power of two, -1 = wrap with %
+int round_pow2 = 0;    // --round-pow2: round buffer_size up to a power of two
+int heap_count = 0;  // items in the heap (POLICY_EDF only)
+int buffer_count = 0;  // items currently buffered, under any policy; written under the
+                       // mutex with relaxed atomics, so lock-free readers do not race
+
+/* Per-level FIFOs (POLICY_LEVELS/POLICY_DRR): level l owns level_fifo[l * buffer_size ...] */
+item *level_fifo;
+int level_head[MAX_LEVELS];
+int level_count[MAX_LEVELS];
+uint64_t level_bitmap = 0;  // bit l set <=> level l is non-empty
+int pending_pills = 0;      // poison pills are not queued, only handed out once all levels drain
+
+/* Deficit round robin state (POLICY_DRR only). Each level is admitted
+ * through its own empty semaphore (buffer_size slots, the size of its FIFO),
+ * so a backlog in one level blocks only that level's producers. With one
+ * shared bound a slow level would fill the buffer and every producer would
+ * wait on it, and dequeue shares would follow the arrival mix, not the
+ * weights. Under DRR each producer is one flow: all its items go to level
+ * (id - 1) % num_levels. */
+sem_t level_empty[MAX_LEVELS];
+int level_weight[MAX_LEVELS];  // quantum added to a level's deficit per round
+int drr_deficit[MAX_LEVELS];
+int drr_current = 0;           // level currently being served
+
+/* Keyed lanes (POLICY_KEYED only): lanes[c] is drained by consumer c + 1 only */
+lane *lanes;
+
+/* Sequence ring (MODE_PIPELINE/MODE_BROADCAST): Disruptor-style, items never
+ * leave their slot. Sequence s lives in buffer[s % buffer_size]. Worker k of
+ * stage t handles the sequences with s % workers_per_stage == k and advances
+ * its own cursor. In a pipeline a stage only reads a slot once the upstream
+ * stage's cursors have passed it, and a producer only reuses a slot once the
+ * last stage has passed it. In broadcast mode each stage is an independent
+ * consumer group reading straight from the producers, and a slot is reclaimed
+ * only once the slowest group has passed it. */
+long claim_seq = 0;         // next sequence a producer will claim
+long *slot_published;       // sequence last published into each slot
+struct timeval *slot_done;  // [slot * num_stages + t]: when stage t finished the slot
+long *stage_cursor;         // [t * workers_per_stage + k]: last sequence done by that worker
+long seq_end = LONG_MAX;    // total sequences, set once all producers have finished
+pthread_mutex_t seq_lock;   // blocking wait strategy: sleepers wait on seq_cond
+pthread_cond_t seq_cond;
+int seq_waiters = 0;
+
+/* Elastic consumer pool (--max-consumers): retirement is close-aware, not a
+ * poison pill. The controller bumps retire_pending and posts one extra full
+ * token; whichever consumer takes a token next sees retire_pending and exits
+ * without touching the buffer. At shutdown queue_closed is set and one token
+ * is posted per live consumer; a consumer exits once it finds the buffer empty.
+ * So full always equals buffered items + retire_pending (+ live consumers
+ * once closed). */
+int retire_pending = 0;  // protected by mutex
+int queue_closed = 0;    // protected by mutex
+pthread_t *consumer_threads;  // every consumer ever started, joined at exit
+int consumer_thread_slots = 0;
+int consumers_started = 0;
+int live_consumers = 0;       // written by the controller only
+int controller_stop = 0;
+
+/* Per-thread stat blocks */
+thread_stats *stats_registry = NULL;  // pushed atomically as threads start
+__thread thread_stats *my_stats = NULL;  // this thread's block (NULL in main)
+
+/* Live sampler (--sample-ms) */
+int sample_ms = 0;  // 0 = sampler off
+int sample_json = 0;  // CSV by default, JSON lines with --sample-format=json
+const char *sample_path = NULL;  // NULL = stdout
+FILE *sample_out;
+int sampler_stop = 0;
+
+/* Prometheus exporter (--prom-socket / --prom-port) */
+const char *prom_socket_path = NULL;  // Unix domain socket
+int prom_port = 0;                    // or a TCP port on 127.0.0.1
+int exporter_fd = -1;
+int exporter_stop = 0;
+
+/* Per-item tracing (--trace) */
+const char *trace_path = NULL;  // NULL = tracing off
+int trace_sample = 1;           // trace items whose seq is a multiple of this
+int trace_ring_size = TRACE_RING_DEFAULT;
+long trace_epoch_ns;            // trace timestamps are relative to this
+
+/* Per-thread counters (--perf) */
+int perf_enabled = 0;
+int perf_errno[PERF_EVENTS];  // first open failure per counter, 0 if it ever opened
+
+/* Open-loop load generation (--rate): each producer follows its own arrival
+ * schedule and stamps an item with its intended send time, so time spent
+ * blocked in insert_item() counts as latency instead of silently lowering
+ * the offered load (coordinated omission) */
+double arrival_rate = 0.0;  // items/s over all producers, 0 = closed loop
+int arrival = ARRIVAL_POISSON;
+int burst_on_ms = 10;   // ARRIVAL_BURSTY window lengths; the rate is averaged over both
+int burst_off_ms = 40;
+histogram send_lag_hist;    // how far behind schedule each send started
+double max_send_lag = 0.0;
+int late_sends = 0;         // sends started more than 1 ms behind schedule
+double last_arrival = 0.0;  // latest intended send time (s after start)
+
+/* Workload record/replay: a replay re-issues the recorded arrivals open loop,
+ * producer p taking the events of recorded producer ids with id % num_producers == p % num_producers */
+const char *record_path = NULL;
+const char *replay_path = NULL;
+double replay_speed = 1.0;     // >1 replays faster than recorded
+workload_header replay_info;   // header of the loaded recording
+workload_event *replay_events; // sorted by replaying producer, then time
+long *replay_first;            // [p]: index of producer p + 1's first event
+long *replay_count;            // [p]: number of events for producer p + 1
+
+/* Synthetic work per item (all zero = no work) */
+work_model producer_work;  // before the item is inserted
+work_model consumer_work;  // after the item is removed (every stage in a pipeline)
+
+/* Exactly-once verification (--verify): consumers mark what they see in
+ * their own bitmaps, main merges them after the run */
+int verify = 0;
+long verify_lost = 0;
+long verify_dups = 0;      // within one consumer or across consumers
+long verify_reorders = 0;
+long verify_corrupt = 0;
+
+/* Item timestamps (--clock=tsc): wall time = tsc_anchor_ns + (rdtsc - tsc_anchor) x tsc_ns_per_tick */
+int item_clock_source = ITEM_CLOCK_GETTIMEOFDAY;
+double tsc_ns_per_tick = 0.0;
+uint64_t tsc_anchor = 0;
+long tsc_anchor_ns = 0;
+
+/* Pooled payloads (--payload): producers fill a pool buffer in place and
+ * queue its handle, consumers read it in place and release it */
+int payload_bytes = 0;  // 0 = items carry no payload
+int pool_buffers = 0;   // 0 = the smallest pool that never blocks
+payload_pool pool;
+
+/* Global variables */
+int num_producers;
+int num_consumers;
+int total_produced = 0;
+int total_consumed = 0;
+
+/* Runtime options (set from --name=value flags after the positional args) */
+int items_per_producer = ITEMS_PER_PRODUCER;
+int quiet = 0;  // suppress the per-item Produced/Consumed lines
+int metrics_format = METRICS_TEXT;
+const char *metrics_path = NULL;  // NULL = stdout
+int aging_ms = 0;  // 0 = strict priority, N = +1 effective priority per N ms queued
+int policy = POLICY_PRIORITY;
+int num_levels = 2;  // 2 = NORMAL/URGENT; up to MAX_LEVELS with --levels
+int deadline_urgent_ms = 5;    // relative deadline of the top level
+int deadline_normal_ms = 500;  // relative deadline of level 0
+int mode = MODE_QUEUE;
+int min_consumers = 1;  // elastic pool bounds; autoscaling is off while max_consumers == 0
+int max_consumers = 0;
+int scale_interval_ms = 100;  // controller sampling period
+int target_p99_ms = 10;       // scale up above this interval p99 latency
+int num_stages = 3;  // enrich -> aggregate -> sink (broadcast: one stage per group)
+int workers_per_stage;  // num_consumers in a pipeline, 1 per broadcast group
+
+/* Metrics for bonus feature */
+struct timeval start_time, end_time;
+double total_latency = 0.0;
+int class_consumed[MAX_LEVELS];        // per-priority consumed count
+double class_total_latency[MAX_LEVELS];
+double class_max_latency[MAX_LEVELS];  // worst-case wait, to check the aging bound
+int deadline_misses[MAX_LEVELS];
+long drr_saturated[MAX_LEVELS];  // dequeues made while every level was backlogged
+double max_lateness = 0.0;
+histogram lateness_hist;  // how late the missed items were
+int scale_ups = 0;
+int scale_downs = 0;
+int peak_consumers = 0;
+int *last_seq;            // last sequence consumed per producer (indexed by id)
+int order_violations = 0; // items consumed after a later item of the same producer
+long stage_items[MAX_STAGES];  // per-stage / per-group metrics (sequence ring modes)
+double stage_total_latency[MAX_STAGES];  // time from upstream stage to this stage
+double stage_max_latency[MAX_STAGES];
+long stage_depth_sum[MAX_STAGES];  // items ready for the stage (a group's lag), sampled per item
+long stage_depth_max[MAX_STAGES];
+long aggregate_sum = 0;
+pthread_mutex_t stats_lock;
+
+/* Function prototypes */
+void *producer(void *param);
+void *consumer(void *param);
+void *stage_worker(void *param);
+void *controller(void *param);
+void *sampler(void *param);
+void *exporter(void *param);
+long now_ns(void);
+void prng_seed(prng *r, uint64_t seed);
+uint64_t prng_next(prng *r);
+void fill_batch(prng *r, item_batch *b);
+void item_clock(struct timeval *tv);
+int tsc_calibrate(void);
+double next_arrival_gap(unsigned int *seed);
+double arrival_offset(double active);
+void sleep_until_ns(long deadline_ns);
+void perf_start(void);
+void perf_stop(void);
+void print_perf_stats(void);
+int trace_wanted(const item *it);
+void trace_record(int kind, const item *it, long t0, long t1, long t2,
+                  long slot_wait_ns, long mutex_wait_ns);
+int write_trace(const char *path);
+int open_exporter_socket(void);
+void write_prometheus(FILE *f);
+void register_thread(char role, int id);
+void stat_add(long *counter, long n);
+void take_snapshot(stats_snapshot *snap);
+void hist_diff(histogram *out, const histogram *now, const histogram *before);
+int queue_depth(void);
+int queue_capacity(void);
+int ring_slot(long seq);
+void blocking_wait(sem_t *sem, int kind);
+long elapsed_ns(const struct timespec *from);
+void print_wait_stats(double total_time);
+const char *policy_name(void);
+const char *mode_name(void);
+const char *arrival_name(void);
+void mw_key(metrics_writer *w, const char *key);
+void mw_open(metrics_writer *w, const char *key);
+void mw_close(metrics_writer *w);
+void mw_int(metrics_writer *w, const char *key, long v);
+void mw_num(metrics_writer *w, const char *key, double v);
+void mw_str(metrics_writer *w, const char *key, const char *v);
+int compare_threads(const void *a, const void *b);
+void write_metrics(FILE *f, int json, double total_time);
+int start_consumer(void);
+void do_work(const work_model *w, unsigned int *seed);
+long work_sample(const work_model *w, long mean, unsigned int *seed);
+int work_enabled(const work_model *w);
+int parse_work(const char *spec, work_model *w);
+void print_work_model(const char *who, const work_model *w);
+void record_consumption(int id, const item *next_consumed);
+void fill_payload(item *it);
+void consume_payload(const item *it);
+void sum_payload_stats(payload_cache *total, histogram *recycle, long *recycle_ns, long *errors);
+void print_payload_stats(void);
+void verify_record(const item *it);
+int verify_report(void);
+void record_arrival(const item *it);
+int compare_events(const void *a, const void *b);
+int write_recording(const char *path, double total_time, double avg_latency, double p99);
+int load_replay(const char *path);
+void insert_item(item next_produced);
+item remove_item(void);
+void insert_lane_item(item next_produced);
+item remove_lane_item(int c);
+int effective_priority(const item *it, const struct timeval *now);
+int deadline_before(const item *a, const item *b);
+int level_deadline_ms(int priority);
+const char *priority_label(int priority, char *buf, size_t len);
+int level_fifos_init(void);
+void level_fifos_destroy(void);
+void level_push(item next_produced);
+item level_pop(void);
+item drr_pop(void);
+int parse_weights(const char *list);
+long stage_progress(int t);
+long gating_progress(void);
+int slot_free(int t, long seq);
+int seq_ready(int t, long seq);
+void seq_wait(int (*ready)(int, long), int t, long seq);
+void seq_signal(void);
+void seq_publish(item next_produced);
+const char *stage_name(int t);
+void heap_push(item next_produced);
+item heap_pop(void);
+int hist_bucket(double seconds);
+void hist_record(histogram *h, double seconds);
+void print_histogram(const char *label, const histogram *h);
+double hist_percentile(const histogram *h, double p);
+const char *option_value(const char *arg, const char *name);
+int parse_option(const char *arg);
+void print_usage(const char *prog);
+int queue_priority(const item *it, const void *now);
+
+/* Queue functions: blocking waits are instrumented, the shared buffer scans
+ * for the most urgent (aged) item, lanes are FIFO */
+BQ_DEFINE_PRIORITY(item_queue, item, 0, queue_priority, blocking_wait, 0)
+BQ_DEFINE_FIFO(item_fifo, item, 0, blocking_wait, 0)
+
+/**
+ * Producer thread implementation
+ */
+void *producer(void *param) {
+    int id = *((int *)param);
+    free(param);
+    register_thread('P', id);
+    perf_start();
+    
+    unsigned int seed = time(NULL) + id;
+    double active = 0.0;  // open loop: arrival clock, excluding burst off-windows
+    prng rng;
+    item_batch batch;
+    prng_seed(&rng, ((uint64_t)time(NULL) << 16) + id);
+    batch.next = GEN_BATCH;
+    
+    const workload_event *events = NULL;
+    int count = items_per_producer;
+    if (replay_path != NULL) {
+        events = replay_events + replay_first[id - 1];
+        count = (int)replay_count[id - 1];
+    }
+    
+    for (int i = 0; i < count; i++) {
+        item next_produced;
+        
+        /* produce an item in next_produced */
+        next_produced.producer_id = id;
+        next_produced.seq = i;
+        if (events != NULL) {
+            next_produced.value = events[i].value;
+            next_produced.priority = (events[i].priority < num_levels)
+                                     ? events[i].priority : num_levels - 1;
+        } else {
+            if (batch.next == GEN_BATCH) {
+                fill_batch(&rng, &batch);
+            }
+            next_produced.value = batch.value[batch.next];
+            next_produced.priority = batch.priority[batch.next++];
+            if (policy == POLICY_DRR) {
+                next_produced.priority = (id - 1) % num_levels;  // one flow per producer
+            }
+        }
+        next_produced.payload = -1;
+        if (payload_bytes > 0) {
+            fill_payload(&next_produced);
+        }
+        do_work(&producer_work, &seed);
+        double lag = 0.0;
+        double offset = -1.0;  // scheduled send time (s after start), open loop only
+        if (events != NULL) {
+            offset = events[i].t_ns / 1e9 / replay_speed;
+        } else if (arrival_rate > 0) {
+            active += next_arrival_gap(&seed);
+            offset = arrival_offset(active);
+        }
+        if (offset >= 0) {
+            /* open loop: wait for the scheduled send time, but never wait to
+             * catch up - a late send keeps its scheduled timestamp */
+            long intended_ns = trace_epoch_ns + (long)(offset * 1e9);
+            sleep_until_ns(intended_ns);
+            lag = (now_ns() - intended_ns) / 1e9;
+            long stamp_us = start_time.tv_usec + (long)(offset * 1e6);
+            next_produced.timestamp.tv_sec = start_time.tv_sec + stamp_us / 1000000;
+            next_produced.timestamp.tv_usec = stamp_us % 1000000;
+        } else {
+            item_clock(&next_produced.timestamp);
+        }
+        long deadline_us = next_produced.timestamp.tv_usec +
+                           level_deadline_ms(next_produced.priority) * 1000L;
+        next_produced.deadline.tv_sec = next_produced.timestamp.tv_sec + deadline_us / 1000000;
+        next_produced.deadline.tv_usec = deadline_us % 1000000;
+        if (record_path != NULL) {
+            record_arrival(&next_produced);
+        }
+        
+        /* insert item into buffer */
+        if (trace_path != NULL && trace_wanted(&next_produced)) {
+            long slot_before = my_stats->wait_ns[WAIT_EMPTY];
+            long mutex_before = my_stats->wait_ns[WAIT_MUTEX];
+            long t0 = now_ns();
+            insert_item(next_produced);
+            trace_record(TRACE_ENQUEUE, &next_produced, t0, now_ns(), 0,
+                         my_stats->wait_ns[WAIT_EMPTY] - slot_before,
+                         my_stats->wait_ns[WAIT_MUTEX] - mutex_before);
+        } else {
+            insert_item(next_produced);
+        }
+        
+        pthread_mutex_lock(&stats_lock);
+        total_produced++;
+        if (offset >= 0) {
+            hist_record(&send_lag_hist, lag);
+            if (lag > max_send_lag) {
+                max_send_lag = lag;
+            }
+            if (lag > 0.001) {
+                late_sends++;
+            }
+            if (offset > last_arrival) {
+                last_arrival = offset;
+            }
+        }
+        pthread_mutex_unlock(&stats_lock);
+        stat_add(&my_stats->produced, 1);
+        
+        if (!quiet) {
+            char label[16];
+            printf("[P%d] Produced: %d (Priority: %s)\n", 
+                   id, next_produced.value,
+                   priority_label(next_produced.priority, label, sizeof(label)));
+        }
+    }
+    
+    perf_stop();
+    if (payload_bytes > 0) {
+        payload_pool_flush(&pool, &my_stats->pool_cache);
+    }
+    printf("[P%d] Finished\n", id);
+    pthread_exit(NULL);
+}
+
+/**
+ * Consumer thread implementation
+ */
+void *consumer(void *param) {
+    int id = *((int *)param);
+    free(param);
+    register_thread('C', id);
+    perf_start();
+    
+    unsigned int seed = time(NULL) + 1000 + id;
+    
+    while (1) {
+        item next_consumed;
+        long t0 = 0, slot_before = 0, mutex_before = 0;
+        if (trace_path != NULL) {
+            t0 = now_ns();
+            slot_before = my_stats->wait_ns[WAIT_FULL];
+            mutex_before = my_stats->wait_ns[WAIT_MUTEX];
+        }
+        
+        /* remove an item from buffer (or from this consumer's lane) to next_consumed */
+        if (policy == POLICY_KEYED) {
+            next_consumed = remove_lane_item(id - 1);
+        } else {
+            next_consumed = remove_item();
+        }
+        
+        /* check for poison pill */
+        if (next_consumed.value == POISON_PILL) {
+            printf("[C%d] Received poison pill. Terminating.\n", id);
+            break;
+        }
+        if (next_consumed.value == RETIRE_SIGNAL) {
+            printf("[C%d] Retired.\n", id);
+            break;
+        }
+        
+        long t1 = (trace_path != NULL) ? now_ns() : 0;
+        record_consumption(id, &next_consumed);
+        if (next_consumed.payload >= 0) {
+            consume_payload(&next_consumed);
+        }
+        do_work(&consumer_work, &seed);
+        if (trace_path != NULL && trace_wanted(&next_consumed)) {
+            trace_record(TRACE_DEQUEUE, &next_consumed, t0, t1, now_ns(),
+                         my_stats->wait_ns[WAIT_FULL] - slot_before,
+                         my_stats->wait_ns[WAIT_MUTEX] - mutex_before);
+        }
+    }
+    
+    perf_stop();
+    if (payload_bytes > 0) {
+        payload_pool_flush(&pool, &my_stats->pool_cache);
+    }
+    pthread_exit(NULL);
+}
+
+/**
+ * Update the consumer statistics for one item and print it
+ */
+void record_consumption(int id, const item *next_consumed) {
+    /* calculate latency (bonus feature) */
+    struct timeval now;
+    item_clock(&now);
+    double latency = (now.tv_sec - next_consumed->timestamp.tv_sec) +
+                    (now.tv_usec - next_consumed->timestamp.tv_usec) / 1000000.0;
+    double lateness = (now.tv_sec - next_consumed->deadline.tv_sec) +
+                     (now.tv_usec - next_consumed->deadline.tv_usec) / 1000000.0;
+    
+    pthread_mutex_lock(&stats_lock);
+    total_consumed++;
+    total_latency += latency;
+
+    class_consumed[next_consumed->priority]++;
+    class_total_latency[next_consumed->priority] += latency;
+    if (latency > class_max_latency[next_consumed->priority]) {
+        class_max_latency[next_consumed->priority] = latency;
+    }
+    if (next_consumed->seq < last_seq[next_consumed->producer_id]) {
+        order_violations++;
+    } else {
+        last_seq[next_consumed->producer_id] = next_consumed->seq;
+    }
+    if (lateness > 0) {
+        deadline_misses[next_consumed->priority]++;
+        hist_record(&lateness_hist, lateness);
+        if (lateness > max_lateness) {
+            max_lateness = lateness;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    if (verify) {
+        verify_record(next_consumed);
+    }
+    stat_add(&my_stats->consumed, 1);
+    stat_add(&my_stats->latency.count[hist_bucket(latency)], 1);
+    stat_add(&my_stats->latency_ns, (long)(latency * 1e9));
+    
+    /* consume the item in next_consumed */
+    if (!quiet) {
+        char label[16];
+        printf("[C%d] Consumed: %d (Priority: %s, Latency: %.6f sec)\n",
+               id, next_consumed->value,
+               priority_label(next_consumed->priority, label, sizeof(label)),
+               latency);
+    }
+}
+
+/**
+ * Take a pool buffer for an item and fill it in place (--payload)
+ * Every byte is the low byte of the item's value, so the consumer can check
+ * the buffer without a copy of what was written.
+ */
+void fill_payload(item *it) {
+    thread_stats *ts = my_stats;
+    int h = payload_pool_alloc(&pool, &ts->pool_cache);
+    long released = pool.released_ns[h];
+    if (released > 0) {
+        long recycle = now_ns() - released;
+        hist_record(&ts->recycle, recycle / 1e9);
+        ts->recycle_ns += recycle;
+    }
+    memset(payload_pool_data(&pool, h), it->value & 0xff, pool.size);
+    it->payload = h;
+}
+
+/**
+ * Read an item's payload in place, one byte per cache line, and release it
+ */
+void consume_payload(const item *it) {
+    const unsigned char *data = payload_pool_data(&pool, it->payload);
+    unsigned char expected = it->value & 0xff;
+    int bad = (data[pool.size - 1] != expected);
+    for (size_t i = 0; i < pool.size; i += 64) {
+        bad |= (data[i] != expected);
+    }
+    if (bad) {
+        my_stats->payload_errors++;
+    }
+    payload_pool_release(&pool, &my_stats->pool_cache, it->payload, now_ns());
+}
+
+/**
+ * Mark one consumed item in this thread's bitmap (--verify)
+ * Items are identified by (producer_id, seq), which every backend carries
+ * through unchanged, so a lost or duplicated item shows up however it was
+ * moved. Nothing is shared between consumers, so this adds no contention.
+ */
+void verify_record(const item *it) {
+    thread_stats *ts = my_stats;
+    if (ts->seen == NULL || it->producer_id < 1 || it->producer_id > num_producers ||
+        it->seq < 0 || it->seq >= items_per_producer) {
+        ts->seen_corrupt++;
+        return;
+    }
+    long bit = (long)(it->producer_id - 1) * items_per_producer + it->seq;
+    uint64_t mask = 1ULL << (bit % 64);
+    if (ts->seen[bit / 64] & mask) {
+        ts->seen_dups++;
+    }
+    ts->seen[bit / 64] |= mask;
+    if (it->seq < ts->seen_last[it->producer_id - 1]) {
+        ts->seen_reorders++;
+    } else {
+        ts->seen_last[it->producer_id - 1] = it->seq;
+    }
+}
+
+/**
+ * Merge the consumers' bitmaps and report loss, duplication and reordering
+ * Returns 0 if every produced item was consumed exactly once, -1 otherwise
+ */
+int verify_report(void) {
+    long bits = (long)num_producers * items_per_producer;
+    long words = (bits + 63) / 64;
+    uint64_t *once = (uint64_t *)calloc(words, sizeof(uint64_t));
+    uint64_t *twice = (uint64_t *)calloc(words, sizeof(uint64_t));
+    if (once == NULL || twice == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(once);
+        free(twice);
+        return -1;
+    }
+    for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+        if (ts->seen == NULL) {
+            continue;
+        }
+        for (long w = 0; w < words; w++) {
+            twice[w] |= once[w] & ts->seen[w];  // seen by an earlier consumer too
+            once[w] |= ts->seen[w];
+        }
+        verify_dups += ts->seen_dups;
+        verify_reorders += ts->seen_reorders;
+        verify_corrupt += ts->seen_corrupt;
+    }
+    
+    /* Producers may have made different numbers of items (--replay) */
+    long *produced_by = (long *)calloc(num_producers, sizeof(long));
+    long expected = 0;
+    for (thread_stats *ts = stats_registry; ts != NULL && produced_by != NULL; ts = ts->next) {
+        if (ts->role == 'P') {
+            produced_by[ts->id - 1] = ts->produced;
+            expected += ts->produced;
+        }
+    }
+    
+    int listed = 0;
+    for (long b = 0; b < bits && produced_by != NULL; b++) {
+        uint64_t mask = 1ULL << (b % 64);
+        if (b % items_per_producer >= produced_by[b / items_per_producer]) {
+            if (once[b / 64] & mask) {
+                verify_corrupt++;  // consumed, but never produced
+            }
+            continue;
+        }
+        if (twice[b / 64] & mask) {
+            verify_dups++;
+            if (listed++ < 10) {
+                printf("  duplicated: P%ld item %ld\n", b / items_per_producer + 1, b % items_per_producer);
+            }
+        }
+        if (!(once[b / 64] & mask)) {
+            verify_lost++;
+            if (listed++ < 10) {
+                printf("  lost: P%ld item %ld\n", b / items_per_producer + 1, b % items_per_producer);
+            }
+        }
+    }
+    free(once);
+    free(twice);
+    
+    printf("Exactly-once check: %ld expected, %ld lost, %ld duplicated, %ld corrupt, "
+           "%ld reordered within a consumer\n",
+           expected, verify_lost, verify_dups, verify_corrupt, verify_reorders);
+    int ok = (produced_by != NULL && verify_lost == 0 && verify_dups == 0 && verify_corrupt == 0);
+    free(produced_by);
+    printf("Verification: %s\n", ok ? "PASSED" : "FAILED");
+    return ok ? 0 : -1;
+}
+
+/**
+ * Insert item into buffer
+ */
+void insert_item(item next_produced) {
+    if (mode != MODE_QUEUE) {
+        seq_publish(next_produced);
+        return;
+    }
+    if (policy == POLICY_KEYED) {
+        insert_lane_item(next_produced);
+        return;
+    }
+    
+    if (policy == POLICY_DRR) {
+        // Per-level admission; poison pills are counted, not stored
+        if (next_produced.value != POISON_PILL) {
+            blocking_wait(&level_empty[next_produced.priority], WAIT_EMPTY);
+        }
+        blocking_wait(&queue.mutex, WAIT_MUTEX);
+    } else {
+        item_queue_begin_put(&queue);  // wait for empty slot, enter critical section
+    }
+    
+    /* Critical Section - Add next_produced to the buffer */
+    if (policy == POLICY_EDF) {
+        heap_push(next_produced);
+    } else if (policy == POLICY_LEVELS || policy == POLICY_DRR) {
+        level_push(next_produced);
+    } else {
+        item_queue_push_locked(&queue, next_produced);
+    }
+    __atomic_store_n(&buffer_count, buffer_count + 1, __ATOMIC_RELAXED);
+    
+    item_queue_end_put(&queue);  // exit critical section, signal full slot
+}
+
+/**
+ * Insert item into the lane owned by its key (POLICY_KEYED)
+ * All items of one producer land in the same lane in production order, and
+ * each lane has a single consumer, so per-producer FIFO order is preserved
+ * while different lanes are drained in parallel.
+ */
+void insert_lane_item(item next_produced) {
+    item_fifo_put(&lanes[next_produced.producer_id % num_consumers].q, next_produced);
+}
+
+/**
+ * Remove the oldest item from lane c (POLICY_KEYED)
+ */
+item remove_lane_item(int c) {
+    item next_consumed = item_fifo_take(&lanes[c].q, NULL);
+    if (next_consumed.value != POISON_PILL) {
+        lanes[c].consumed++;
+    }
+    return next_consumed;
+}
+
+/**
+ * Highest sequence that every worker of stage t has finished
+ * Worker k starts at cursor k - n and steps by n, so all sequences below
+ * cursor + n that it owns are done; the stage is done up to the minimum.
+ */
+long stage_progress(int t) {
+    long lowest = LONG_MAX;
+    for (int k = 0; k < workers_per_stage; k++) {
+        long cursor = __atomic_load_n(&stage_cursor[t * workers_per_stage + k], __ATOMIC_SEQ_CST);
+        if (cursor < lowest) {
+            lowest = cursor;
+        }
+    }
+    return lowest + workers_per_stage - 1;
+}
+
+/**
+ * Highest sequence whose slot may be reused: the last pipeline stage's
+ * progress, or the slowest broadcast group's
+ */
+long gating_progress(void) {
+    if (mode == MODE_PIPELINE) {
+        return stage_progress(num_stages - 1);
+    }
+    long slowest = LONG_MAX;
+    for (int t = 0; t < num_stages; t++) {
+        long progress = stage_progress(t);
+        if (progress < slowest) {
+            slowest = progress;
+        }
+    }
+    return slowest;
+}
+
+/**
+ * Producer gate: may sequence seq overwrite its slot? (t is unused)
+ */
+int slot_free(int t, long seq) {
+    (void)t;
+    return seq - buffer_size <= gating_progress();
+}
+
+/**
+ * Stage gate: is sequence seq ready for stage t, or is the run over?
+ */
+int seq_ready(int t, long seq) {
+    if (seq >= __atomic_load_n(&seq_end, __ATOMIC_SEQ_CST)) {
+        return 1;
+    }
+    if (t == 0 || mode == MODE_BROADCAST) {
+        return __atomic_load_n(&slot_published[ring_slot(seq)], __ATOMIC_SEQ_CST) == seq;
+    }
+    return stage_progress(t - 1) >= seq;
+}
+
+/**
+ * Block until ready(t, seq) holds (blocking wait strategy, no busy-waiting)
+ * The waiter registers in seq_waiters before re-checking, and every cursor
+ * update checks seq_waiters after storing, so a wakeup cannot be missed.
+ */
+void seq_wait(int (*ready)(int, long), int t, long seq) {
+    if (ready(t, seq)) {
+        if (my_stats != NULL) {
+            stat_add(&my_stats->fast_acquires[WAIT_RING], 1);
+        }
+        return;
+    }
+    struct timespec wait_start;
+    clock_gettime(CLOCK_MONOTONIC, &wait_start);
+    if (my_stats != NULL) {
+        __atomic_store_n(&my_stats->blocked, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&seq_lock);
+    __atomic_add_fetch(&seq_waiters, 1, __ATOMIC_SEQ_CST);
+    while (!ready(t, seq)) {
+        pthread_cond_wait(&seq_cond, &seq_lock);
+    }
+    __atomic_sub_fetch(&seq_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&seq_lock);
+    if (my_stats != NULL) {
+        __atomic_store_n(&my_stats->blocked, 0, __ATOMIC_RELAXED);
+        stat_add(&my_stats->waits[WAIT_RING], 1);
+        stat_add(&my_stats->wait_ns[WAIT_RING], elapsed_ns(&wait_start));
+    }
+}
+
+/**
+ * Wake all waiters after a cursor moved (cheap when nobody sleeps)
+ */
+void seq_signal(void) {
+    if (__atomic_load_n(&seq_waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&seq_lock);
+        pthread_cond_broadcast(&seq_cond);
+        pthread_mutex_unlock(&seq_lock);
+    }
+}
+
+/**
+ * Claim the next sequence, write the item into its slot and publish it
+ */
+void seq_publish(item next_produced) {
+    long seq = __atomic_fetch_add(&claim_seq, 1, __ATOMIC_SEQ_CST);
+    seq_wait(slot_free, 0, seq);
+    buffer[ring_slot(seq)] = next_produced;
+    __atomic_store_n(&slot_published[ring_slot(seq)], seq, __ATOMIC_SEQ_CST);
+    seq_signal();
+}
+
+/**
+ * Role of pipeline stage t
+ */
+const char *stage_name(int t) {
+    if (mode == MODE_BROADCAST) {
+        return "group";
+    }
+    if (t == num_stages - 1) {
+        return "sink";
+    }
+    return (t == 0) ? "enrich" : "aggregate";
+}
+
+/**
+ * Sequence ring worker (MODE_PIPELINE/MODE_BROADCAST)
+ * Pipeline: processes its share of the sequences in place in the ring: enrich
+ * rewrites the value, aggregate folds it into a running sum, and the sink
+ * consumes it like a regular consumer.
+ * Broadcast: consumer group t reads every item; group 1 feeds the regular
+ * consumer statistics, so totals still count each item once.
+ */
+void *stage_worker(void *param) {
+    int id = *((int *)param);  // t * workers_per_stage + k
+    free(param);
+    int t = id / workers_per_stage;
+    int k = id % workers_per_stage;
+    register_thread('C', id + 1);
+    perf_start();
+    long *cursor = &stage_cursor[id];
+    unsigned int seed = time(NULL) + 1000 + id;
+    
+    long items = 0, depth_sum = 0, depth_max = 0, sum = 0;
+    double total_wait = 0.0, max_wait = 0.0;
+    
+    int traced_stage = (mode == MODE_PIPELINE) ? num_stages - 1 : 0;
+    for (long seq = k; ; seq += workers_per_stage) {
+        long t0 = 0, ring_before = 0;
+        if (trace_path != NULL && t == traced_stage) {
+            t0 = now_ns();
+            ring_before = my_stats->wait_ns[WAIT_RING];
+        }
+        seq_wait(seq_ready, t, seq);
+        if (seq >= __atomic_load_n(&seq_end, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        
+        /* Queue depth seen by this stage: sequences ready upstream but not done here */
+        long upstream;
+        if (t == 0 || mode == MODE_BROADCAST) {
+            // Claimed sequences, minus those still waiting for a free slot
+            upstream = __atomic_load_n(&claim_seq, __ATOMIC_SEQ_CST) - 1;
+            if (upstream > gating_progress() + buffer_size) {
+                upstream = gating_progress() + buffer_size;
+            }
+        } else {
+            upstream = stage_progress(t - 1);
+        }
+        long depth = upstream - seq + 1;
+        depth_sum += depth;
+        if (depth > depth_max) {
+            depth_max = depth;
+        }
+        
+        int slot = ring_slot(seq);
+        item *it = &buffer[slot];
+        struct timeval now;
+        item_clock(&now);
+        const struct timeval *since = (t == 0 || mode == MODE_BROADCAST)
+                                      ? &it->timestamp
+                                      : &slot_done[slot * num_stages + t - 1];
+        double wait = (now.tv_sec - since->tv_sec) + (now.tv_usec - since->tv_usec) / 1000000.0;
+        total_wait += wait;
+        if (wait > max_wait) {
+            max_wait = wait;
+        }
+        
+        long t1 = (t0 != 0) ? now_ns() : 0;
+        if (mode == MODE_BROADCAST) {
+            if (t == 0) {
+                record_consumption(1, it);
+            } else if (!quiet) {
+                printf("[C%d] Consumed: %d (replica, Latency: %.6f sec)\n", t + 1, it->value, wait);
+            }
+        } else if (t == num_stages - 1) {
+            record_consumption(k + 1, it);
+        } else if (t == 0) {
+            it->value *= 2;
+        } else {
+            sum += it->value;
+        }
+        do_work(&consumer_work, &seed);
+        if (t0 != 0 && trace_wanted(it)) {
+            trace_record(TRACE_DEQUEUE, it, t0, t1, now_ns(),
+                         my_stats->wait_ns[WAIT_RING] - ring_before, 0);
+        }
+        slot_done[slot * num_stages + t] = now;
+        items++;
+        
+        __atomic_store_n(cursor, seq, __ATOMIC_SEQ_CST);
+        seq_signal();
+    }
+    
+    perf_stop();
+    pthread_mutex_lock(&stats_lock);
+    stage_items[t] += items;
+    stage_total_latency[t] += total_wait;
+    if (max_wait > stage_max_latency[t]) {
+        stage_max_latency[t] = max_wait;
+    }
+    stage_depth_sum[t] += depth_sum;
+    if (depth_max > stage_depth_max[t]) {
+        stage_depth_max[t] = depth_max;
+    }
+    aggregate_sum += sum;
+    pthread_mutex_unlock(&stats_lock);
+    
+    pthread_exit(NULL);
+}
+
+/**
+ * Relative deadline of a priority level
+ * Interpolates linearly from deadline_normal_ms (level 0) to deadline_urgent_ms
+ * (top level), so with two levels NORMAL and URGENT get exactly those values.
+ */
+int level_deadline_ms(int priority) {
+    return deadline_normal_ms +
+           (deadline_urgent_ms - deadline_normal_ms) * priority / (num_levels - 1);
+}
+
+/**
+ * Human-readable priority: NORMAL/URGENT with two levels, L<n> otherwise
+ */
+const char *priority_label(int priority, char *buf, size_t len) {
+    if (num_levels == 2) {
+        return priority ? "URGENT" : "NORMAL";
+    }
+    snprintf(buf, len, "L%d", priority);
+    return buf;
+}
+
+/**
+ * Allocate the per-level FIFOs, and under DRR each level's empty semaphore
+ * Returns 0, or -1 if out of memory
+ */
+int level_fifos_init(void) {
+    level_fifo = (item *)malloc((size_t)num_levels * buffer_size * sizeof(item));
+    if (level_fifo == NULL) {
+        return -1;
+    }
+    if (policy == POLICY_DRR) {
+        for (int l = 0; l < num_levels; l++) {
+            sem_init(&level_empty[l], 0, buffer_size);
+        }
+    }
+    return 0;
+}
+
+void level_fifos_destroy(void) {
+    if (level_fifo != NULL && policy == POLICY_DRR) {
+        for (int l = 0; l < num_levels; l++) {
+            sem_destroy(&level_empty[l]);
+        }
+    }
+    free(level_fifo);
+    level_fifo = NULL;
+}
+
+/**
+ * Append an item to its level's FIFO (caller holds mutex)
+ * Each level has buffer_size slots, so it can never overflow: the empty
+ * semaphore bounds the total, or under DRR the level's own level_empty.
+ */
+void level_push(item next_produced) {
+    if (next_produced.value == POISON_PILL) {
+        pending_pills++;
+        return;
+    }
+    int l = next_produced.priority;
+    int tail = ring_slot(level_head[l] + level_count[l]);
+    level_fifo[l * buffer_size + tail] = next_produced;
+    level_count[l]++;
+    level_bitmap |= (uint64_t)1 << l;
+}
+
+/**
+ * Take the oldest item of the highest non-empty level (caller holds mutex)
+ * Level selection is one count-leading-zeros instruction on the bitmap, so
+ * the cost does not depend on how many levels are configured.
+ */
+item level_pop(void) {
+    if (level_bitmap == 0) {
+        // Only poison pills are left
+        item poison;
+        memset(&poison, 0, sizeof(poison));
+        poison.value = POISON_PILL;
+        poison.priority = -1;
+        pending_pills--;
+        return poison;
+    }
+    int l = 63 - __builtin_clzll(level_bitmap);
+    item next_consumed = level_fifo[l * buffer_size + level_head[l]];
+    level_head[l] = ring_slot(level_head[l] + 1);
+    if (--level_count[l] == 0) {
+        level_bitmap &= ~((uint64_t)1 << l);
+    }
+    return next_consumed;
+}
+
+/**
+ * Take the next item under deficit round robin (caller holds mutex)
+ * Levels are visited cyclically; each visit adds the level's weight to its
+ * deficit and every item served costs one unit, so while several levels are
+ * backlogged each gets weight / sum(weights) of the dequeues. The next
+ * backlogged level is found from the occupancy bitmap, not by a scan.
+ */
+item drr_pop(void) {
+    if (level_bitmap == 0) {
+        return level_pop();  // only poison pills are left
+    }
+    while (1) {
+        int l = drr_current;
+        if (level_count[l] > 0 && drr_deficit[l] >= 1) {
+            if (__builtin_popcountll(level_bitmap) == num_levels) {
+                drr_saturated[l]++;
+            }
+            item next_consumed = level_fifo[l * buffer_size + level_head[l]];
+            level_head[l] = ring_slot(level_head[l] + 1);
+            drr_deficit[l]--;
+            if (--level_count[l] == 0) {
+                level_bitmap &= ~((uint64_t)1 << l);
+                drr_deficit[l] = 0;  // idle levels do not bank credit
+            }
+            return next_consumed;
+        }
+        // Advance to the next backlogged level after l, wrapping around
+        uint64_t higher = (l == MAX_LEVELS - 1) ? 0 : level_bitmap & ~((((uint64_t)1) << (l + 1)) - 1);
+        drr_current = higher ? __builtin_ctzll(higher) : __builtin_ctzll(level_bitmap);
+        drr_deficit[drr_current] += level_weight[drr_current];
+    }
+}
+
+/**
+ * Heap ordering for POLICY_EDF: does a have an earlier deadline than b?
+ */
+int deadline_before(const item *a, const item *b) {
+    return timercmp(&a->deadline, &b->deadline, <);
+}
+
+/**
+ * Push an item onto the deadline min-heap (caller holds mutex)
+ * The empty semaphore guarantees heap_count < buffer_size here.
+ */
+void heap_push(item next_produced) {
+    int pos = heap_count++;
+    // Sift up: move parents down until next_produced's slot is found
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (!deadline_before(&next_produced, &buffer[parent])) {
+            break;
+        }
+        buffer[pos] = buffer[parent];
+        pos = parent;
+    }
+    buffer[pos] = next_produced;
+}
+
+/**
+ * Pop the earliest-deadline item from the min-heap (caller holds mutex)
+ * The full semaphore guarantees heap_count > 0 here.
+ */
+item heap_pop(void) {
+    item earliest = buffer[0];
+    item last = buffer[--heap_count];
+    int pos = 0;
+    // Sift down: move the earlier child up until last's slot is found
+    while (1) {
+        int child = 2 * pos + 1;
+        if (child >= heap_count) {
+            break;
+        }
+        if (child + 1 < heap_count && deadline_before(&buffer[child + 1], &buffer[child])) {
+            child++;
+        }
+        if (!deadline_before(&buffer[child], &last)) {
+            break;
+        }
+        buffer[pos] = buffer[child];
+        pos = child;
+    }
+    if (heap_count > 0) {
+        buffer[pos] = last;
+    }
+    return earliest;
+}
+
+/**
+ * Effective priority of a buffered item under the aging policy.
+ * Every aging_ms spent in the buffer raises an item by one level, so a NORMAL
+ * item that has waited aging_ms ties with a fresh URGENT item and wins on FIFO
+ * order. Its wait is then bounded by aging_ms plus the time to drain the items
+ * queued ahead of it. Poison pills never age: they must stay behind real items.
+ */
+int effective_priority(const item *it, const struct timeval *now) {
+    if (aging_ms <= 0 || it->value == POISON_PILL) {
+        return it->priority;
+    }
+    long waited_ms = (now->tv_sec - it->timestamp.tv_sec) * 1000L +
+                     (now->tv_usec - it->timestamp.tv_usec) / 1000L;
+    return it->priority + (int)(waited_ms / aging_ms);
+}
+
+/**
+ * Remove item from buffer
+ * Bonus: Priority handling - urgent items consumed before normal items
+ * (with --aging-ms, long-waiting normal items eventually overtake urgent ones)
+ */
+item remove_item(void) {
+    item_queue_begin_take(&queue);  // wait for full slot, enter critical section
+    
+    /* Critical Section - Remove item from buffer */
+    if (retire_pending > 0 || (queue_closed && buffer_count == 0)) {
+        // Elastic pool: this token asked us to exit, no slot is freed
+        if (retire_pending > 0) {
+            retire_pending--;
+        }
+        sem_post(&queue.mutex);
+        item retire;
+        memset(&retire, 0, sizeof(retire));
+        retire.value = RETIRE_SIGNAL;
+        return retire;
+    }
+    __atomic_store_n(&buffer_count, buffer_count - 1, __ATOMIC_RELAXED);
+    item next_consumed;
+    if (policy == POLICY_EDF) {
+        // O(log n) heap pop or O(1) bitmap lookup, no scan
+        next_consumed = heap_pop();
+    } else if (policy == POLICY_DRR) {
+        next_consumed = drr_pop();
+    } else if (policy == POLICY_LEVELS) {
+        next_consumed = level_pop();
+    } else {
+        // Bonus: Priority handling via linear scan and extraction
+        struct timeval now;
+        if (aging_ms > 0) {
+            item_clock(&now);  // one clock read per scan, not per item
+        }
+        next_consumed = item_queue_pop_locked(&queue, &now);
+    }
+    
+    if (policy == POLICY_DRR) {
+        // Free a slot in the item's own level (pills never took one)
+        sem_post(&queue.mutex);
+        if (next_consumed.value != POISON_PILL) {
+            sem_post(&level_empty[next_consumed.priority]);
+        }
+        return next_consumed;
+    }
+    item_queue_end_take(&queue);  // exit critical section, signal empty slot
+    
+    return next_consumed;
+}
+
+/**
+ * Priority of a buffered item for the shared queue's scan (now: struct timeval)
+ */
+int queue_priority(const item *it, const void *now) {
+    return effective_priority(it, (const struct timeval *)now);
+}
+
+/**
+ * Start one more consumer thread (controller and main only)
+ * Returns 0, or -1 with an error printed if the thread could not be started
+ */
+int start_consumer(void) {
+    if (consumers_started == consumer_thread_slots) {
+        pthread_t *grown = (pthread_t *)realloc(consumer_threads,
+                                                2 * consumer_thread_slots * sizeof(pthread_t));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: no memory for another consumer thread\n");
+            return -1;
+        }
+        consumer_threads = grown;
+        consumer_thread_slots *= 2;
+    }
+    int *id = (int *)malloc(sizeof(int));
+    if (id == NULL) {
+        fprintf(stderr, "Error: no memory for another consumer thread\n");
+        return -1;
+    }
+    *id = consumers_started + 1;
+    int err = pthread_create(&consumer_threads[consumers_started], NULL, consumer, id);
+    if (err != 0) {
+        fprintf(stderr, "Error: cannot start consumer C%d: %s\n", *id, strerror(err));
+        free(id);
+        return -1;
+    }
+    consumers_started++;
+    live_consumers++;
+    if (live_consumers > peak_consumers) {
+        peak_consumers = live_consumers;
+    }
+    return 0;
+}
+
+/**
+ * Autoscaling controller thread (--max-consumers)
+ * Every scale_interval_ms samples buffer occupancy and the interval's p99
+ * latency, then adds a consumer when the queue is backing up or p99 is over
+ * target, and retires one when the queue is nearly empty and p99 is well
+ * under target. Every decision is logged with the sample that caused it.
+ */
+void *controller(void *param) {
+    (void)param;
+    stats_snapshot before, now;
+    take_snapshot(&before);
+    
+    while (!__atomic_load_n(&controller_stop, __ATOMIC_SEQ_CST)) {
+        usleep(scale_interval_ms * 1000);
+        
+        histogram interval;
+        take_snapshot(&now);
+        hist_diff(&interval, &now.latency, &before.latency);
+        long consumed = now.consumed - before.consumed;
+        before = now;
+        
+        double occupancy = (double)__atomic_load_n(&buffer_count, __ATOMIC_RELAXED) /
+                           queue_capacity();
+        double p99 = hist_percentile(&interval, 0.99);
+        double target = target_p99_ms / 1000.0;
+        const char *reason = NULL;
+        int delta = 0;
+        
+        if (live_consumers < max_consumers && (occupancy > 0.75 || p99 > target)) {
+            reason = (occupancy > 0.75) ? "queue backing up" : "p99 over target";
+            delta = 1;
+        } else if (live_consumers > min_consumers && occupancy < 0.25 && p99 < target / 2) {
+            reason = "queue draining";
+            delta = -1;
+        }
+        if (delta == 0) {
+            continue;
+        }
+        
+        printf("[SCALE] occupancy %.0f%%, p99 %.6f s, %.0f items/s: consumers %d -> %d (%s)\n",
+               occupancy * 100, p99, consumed * 1000.0 / scale_interval_ms,
+               live_consumers, live_consumers + delta, reason);
+        if (delta > 0) {
+            if (start_consumer() == 0) {
+                scale_ups++;
+            }
+        } else {
+            sem_wait(&queue.mutex);
+            retire_pending++;
+            sem_post(&queue.mutex);
+            sem_post(&queue.full);  // wake one consumer to take the retirement
+            live_consumers--;
+            scale_downs++;
+        }
+    }
+    
+    pthread_exit(NULL);
+}
+
+/**
+ * Live sampler thread (--sample-ms)
+ * Every sample_ms sums the per-thread counters (no locks, workers keep
+ * running) and prints one CSV row or JSON line with the interval's
+ * throughput, latency percentiles, queue occupancy and blocked threads.
+ */
+void *sampler(void *param) {
+    (void)param;
+    stats_snapshot before, now;
+    struct timeval t0, t1;
+    take_snapshot(&before);
+    gettimeofday(&t0, NULL);
+    
+    if (!sample_json) {
+        fprintf(sample_out, "elapsed_ms,throughput,occupancy,p50_ms,p90_ms,p99_ms,"
+                            "blocked_producers,blocked_consumers\n");
+    }
+    while (!__atomic_load_n(&sampler_stop, __ATOMIC_SEQ_CST)) {
+        usleep(sample_ms * 1000);
+        
+        histogram interval;
+        take_snapshot(&now);
+        gettimeofday(&t1, NULL);
+        hist_diff(&interval, &now.latency, &before.latency);
+        double elapsed_ms = (t1.tv_sec - start_time.tv_sec) * 1000.0 +
+                            (t1.tv_usec - start_time.tv_usec) / 1000.0;
+        double dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1000000.0;
+        double throughput = (dt > 0) ? (now.consumed - before.consumed) / dt : 0.0;
+        double occupancy = (double)queue_depth() / queue_capacity();
+        double p50 = hist_percentile(&interval, 0.50) * 1000.0;
+        double p90 = hist_percentile(&interval, 0.90) * 1000.0;
+        double p99 = hist_percentile(&interval, 0.99) * 1000.0;
+        
+        if (sample_json) {
+            fprintf(sample_out, "{\"elapsed_ms\": %.1f, \"throughput\": %.1f, \"occupancy\": %.3f, "
+                                "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, "
+                                "\"blocked_producers\": %d, \"blocked_consumers\": %d}\n",
+                    elapsed_ms, throughput, occupancy, p50, p90, p99,
+                    now.blocked_producers, now.blocked_consumers);
+        } else {
+            fprintf(sample_out, "%.1f,%.1f,%.3f,%.3f,%.3f,%.3f,%d,%d\n",
+                    elapsed_ms, throughput, occupancy, p50, p90, p99,
+                    now.blocked_producers, now.blocked_consumers);
+        }
+        fflush(sample_out);
+        before = now;
+        t0 = t1;
+    }
+    
+    pthread_exit(NULL);
+}
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * Seed a generator from one 64-bit value, expanded with splitmix64 so that
+ * nearby seeds (consecutive producer ids) give unrelated streams
+ */
+void prng_seed(prng *r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        r->s[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * Next 64 random bits (xoshiro256**): a few shifts, rotates and multiplies,
+ * no division and no shared state, unlike rand_r()
+ */
+uint64_t prng_next(prng *r) {
+    uint64_t *s = r->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+/**
+ * Refill a producer's batch: one 64-bit draw per item, the low half picks
+ * the value in 1..1000 and the high half the priority, both by
+ * multiply-shift instead of %. The mapping loop has no branches or calls,
+ * so the compiler can vectorize it.
+ */
+void fill_batch(prng *r, item_batch *b) {
+    uint64_t bits[GEN_BATCH];
+    for (int i = 0; i < GEN_BATCH; i++) {
+        bits[i] = prng_next(r);
+    }
+    uint32_t levels = (num_levels == 2) ? 100 : (uint32_t)num_levels;
+    int urgent_share = (num_levels == 2);  // 2 levels: 25% urgent, else uniform over levels
+    for (int i = 0; i < GEN_BATCH; i++) {
+        uint32_t lo = (uint32_t)bits[i];
+        uint32_t hi = (uint32_t)(bits[i] >> 32);
+        int draw = (int)(((uint64_t)hi * levels) >> 32);
+        b->value[i] = 1 + (int)(((uint64_t)lo * 1000) >> 32);
+        b->priority[i] = urgent_share ? (draw < 25) : draw;
+    }
+    b->next = 0;
+}
+
+/**
+ * Timestamp for an item's latency: gettimeofday(), or with --clock=tsc the
+ * time stamp counter scaled to wall-clock time (no system call, no vDSO
+ * page, a few ns per read)
+ */
+void item_clock(struct timeval *tv) {
+#if HAVE_TSC
+    if (item_clock_source == ITEM_CLOCK_TSC) {
+        long ns = tsc_anchor_ns + (long)((int64_t)(__rdtsc() - tsc_anchor) * tsc_ns_per_tick);
+        tv->tv_sec = ns / 1000000000L;
+        tv->tv_usec = (ns % 1000000000L) / 1000;
+        return;
+    }
+#endif
+    gettimeofday(tv, NULL);
+}
+
+/**
+ * Measure the TSC rate against the monotonic clock over 20 ms and anchor it
+ * to the wall clock. Returns -1 without an invariant TSC, whose rate would
+ * change with the CPU frequency.
+ */
+int tsc_calibrate(void) {
+#if HAVE_TSC
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))) {
+        return -1;
+    }
+    long mono0 = now_ns();
+    uint64_t tsc0 = __rdtsc();
+    usleep(20000);
+    struct timeval wall;
+    gettimeofday(&wall, NULL);
+    long mono1 = now_ns();
+    uint64_t tsc1 = __rdtsc();
+    tsc_ns_per_tick = (double)(mono1 - mono0) / (double)(tsc1 - tsc0);
+    tsc_anchor = tsc1;
+    tsc_anchor_ns = wall.tv_sec * 1000000000L + wall.tv_usec * 1000L;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Draw the next inter-arrival gap of one producer, in seconds of active time
+ * Each producer offers arrival_rate / num_producers items per second.
+ */
+double next_arrival_gap(unsigned int *seed) {
+    double rate = arrival_rate / num_producers;
+    if (arrival == ARRIVAL_CONSTANT) {
+        return 1.0 / rate;
+    }
+    if (arrival == ARRIVAL_BURSTY) {
+        rate = rate * (burst_on_ms + burst_off_ms) / burst_on_ms;  // same mean rate
+    }
+    double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);  // (0, 1)
+    return -log(u) / rate;
+}
+
+/**
+ * Map active time to seconds since start by inserting the burst off-windows
+ * The windows are aligned across producers, so bursts hit the queue together.
+ */
+double arrival_offset(double active) {
+    if (arrival != ARRIVAL_BURSTY) {
+        return active;
+    }
+    double on = burst_on_ms / 1000.0, off = burst_off_ms / 1000.0;
+    double windows = floor(active / on);
+    return windows * (on + off) + (active - windows * on);
+}
+
+/**
+ * Sleep until the monotonic clock reaches deadline_ns (no-op if already past)
+ */
+void sleep_until_ns(long deadline_ns) {
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000L;
+    ts.tv_nsec = deadline_ns % 1000000000L;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        continue;
+    }
+}
+
+/**
+ * Whether a work model costs anything at all
+ */
+int work_enabled(const work_model *w) {
+    return w->spin_ns > 0 || w->sleep_us > 0 || w->touch_kb > 0;
+}
+
+/**
+ * Draw one cost with the given mean from the model's distribution
+ */
+long work_sample(const work_model *w, long mean, unsigned int *seed) {
+    double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);  // (0, 1)
+    if (w->dist == WORK_EXP) {
+        return (long)(-log(u) * mean);
+    }
+    if (w->dist == WORK_UNIFORM) {
+        return (long)(u * 2 * mean);
+    }
+    return mean;
+}
+
+/**
+ * Spend one item's synthetic cost: spin on the CPU, write through the
+ * thread's working set (one store per cache line), then block
+ */
+void do_work(const work_model *w, unsigned int *seed) {
+    if (!work_enabled(w)) {
+        return;
+    }
+    long start = now_ns();
+    if (w->spin_ns > 0) {
+        long until = start + work_sample(w, w->spin_ns, seed);
+        while (now_ns() < until) {
+            // busy: CPU-bound processing
+        }
+    }
+    if (w->touch_kb > 0) {
+        if (my_stats->work_set == NULL) {
+            my_stats->work_set = (char *)calloc(w->touch_kb, 1024);
+        }
+        volatile char *set = my_stats->work_set;
+        for (long off = 0; set != NULL && off < w->touch_kb * 1024L; off += 64) {
+            set[off]++;
+        }
+    }
+    if (w->sleep_us > 0) {
+        sleep_until_ns(now_ns() + work_sample(w, w->sleep_us, seed) * 1000);
+    }
+    stat_add(&my_stats->work_items, 1);
+    stat_add(&my_stats->work_ns, now_ns() - start);
+}
+
+/**
+ * Describe a work model in the configuration header
+ */
+void print_work_model(const char *who, const work_model *w) {
+    static const char *dist_names[] = {"fixed", "exp", "uniform"};
+    printf("%s work per item: spin %ld ns, touch %d KB, sleep %ld us (%s)\n",
+           who, w->spin_ns, w->touch_kb, w->sleep_us, dist_names[w->dist]);
+}
+
+/**
+ * Append one arrival to this producer's recording (--record)
+ */
+void record_arrival(const item *it) {
+    thread_stats *ts = my_stats;
+    if (ts->recorded_count == ts->recorded_slots) {
+        long slots = (ts->recorded_slots > 0) ? 2 * ts->recorded_slots : 1024;
+        workload_event *grown = (workload_event *)realloc(ts->recorded,
+                                                          slots * sizeof(workload_event));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: recording buffer full, arrival of P%d item %d dropped\n",
+                    it->producer_id, it->seq);
+            return;
+        }
+        ts->recorded = grown;
+        ts->recorded_slots = slots;
+    }
+    workload_event *ev = &ts->recorded[ts->recorded_count++];
+    memset(ev, 0, sizeof(*ev));
+    ev->t_ns = (it->timestamp.tv_sec - start_time.tv_sec) * 1000000000L +
+               (it->timestamp.tv_usec - start_time.tv_usec) * 1000L;
+    ev->value = it->value;
+    ev->size = (payload_bytes > 0) ? (uint32_t)payload_bytes : sizeof(item);
+    ev->producer_id = (uint16_t)it->producer_id;
+    ev->priority = (uint16_t)it->priority;
+}
+
+/**
+ * qsort order of workload events: by producer, then by arrival time
+ */
+int compare_events(const void *a, const void *b) {
+    const workload_event *x = (const workload_event *)a;
+    const workload_event *y = (const workload_event *)b;
+    if (x->producer_id != y->producer_id) {
+        return (x->producer_id < y->producer_id) ? -1 : 1;
+    }
+    return (x->t_ns > y->t_ns) - (x->t_ns < y->t_ns);
+}
+
+/**
+ * Write every producer's recorded arrivals, plus this run's results, to path
+ * Returns 0 on success, -1 on error
+ */
+int write_recording(const char *path, double total_time, double avg_latency, double p99) {
+    long count = 0;
+    for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+        count += ts->recorded_count;
+    }
+    workload_event *all = (workload_event *)malloc((count + 1) * sizeof(workload_event));
+    FILE *f = fopen(path, "wb");
+    if (all == NULL || f == NULL) {
+        free(all);
+        if (f != NULL) {
+            fclose(f);
+        }
+        return -1;
+    }
+    long n = 0;
+    for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+        if (ts->recorded_count == 0) {
+            continue;  // e.g. consumers, whose recorded is NULL
+        }
+        memcpy(all + n, ts->recorded, ts->recorded_count * sizeof(workload_event));
+        n += ts->recorded_count;
+    }
+    qsort(all, count, sizeof(workload_event), compare_events);
+    
+    workload_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, WORKLOAD_MAGIC, sizeof(h.magic));
+    h.version = WORKLOAD_VERSION;
+    h.producers = num_producers;
+    h.count = count;
+    h.duration_s = total_time;
+    h.throughput = (total_time > 0) ? total_consumed / total_time : 0.0;
+    h.avg_latency_s = avg_latency;
+    h.p99_latency_s = p99;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             (long)fwrite(all, sizeof(workload_event), count, f) == count;
+    free(all);
+    return (fclose(f) == 0 && ok) ? 0 : -1;
+}
+
+/**
+ * Load a recording for --replay and split its events over num_producers
+ * Recorded producer r is replayed by producer (r - 1) % num_producers + 1.
+ * Returns 0 on success, -1 if the file is missing, truncated or not a recording
+ */
+int load_replay(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    if (fread(&replay_info, sizeof(replay_info), 1, f) != 1 ||
+        memcmp(replay_info.magic, WORKLOAD_MAGIC, sizeof(replay_info.magic)) != 0 ||
+        replay_info.version != WORKLOAD_VERSION || replay_info.count > INT_MAX) {
+        fclose(f);
+        return -1;
+    }
+    long count = (long)replay_info.count;
+    replay_events = (workload_event *)malloc((count + 1) * sizeof(workload_event));
+    replay_first = (long *)calloc(num_producers, sizeof(long));
+    replay_count = (long *)calloc(num_producers, sizeof(long));
+    if (replay_events == NULL || replay_first == NULL || replay_count == NULL ||
+        (long)fread(replay_events, sizeof(workload_event), count, f) != count) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    
+    for (long e = 0; e < count; e++) {
+        int p = (replay_events[e].producer_id > 0 ? replay_events[e].producer_id - 1 : 0)
+                % num_producers;
+        replay_events[e].producer_id = (uint16_t)(p + 1);
+        replay_count[p]++;
+    }
+    qsort(replay_events, count, sizeof(workload_event), compare_events);
+    items_per_producer = 1;  // per-producer item count, for --verify and the metrics
+    for (int p = 0; p < num_producers; p++) {
+        replay_first[p] = (p > 0) ? replay_first[p - 1] + replay_count[p - 1] : 0;
+        if (replay_count[p] > items_per_producer) {
+            items_per_producer = (int)replay_count[p];
+        }
+    }
+    return 0;
+}
+
+/**
+ * Open and start this thread's counters (--perf)
+ * Each counter is opened on its own, so an unsupported one (common in VMs
+ * and containers, or with perf_event_paranoid > 2) only disables itself.
+ * User-space only for the hardware events, so paranoid level 2 is enough.
+ */
+void perf_start(void) {
+    static const struct { unsigned int type; unsigned long long config; } events[PERF_EVENTS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    };
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        my_stats->perf_fd[e] = -1;
+        if (!perf_enabled) {
+            continue;
+        }
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[e].type;
+        attr.config = events[e].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = (events[e].type != PERF_TYPE_SOFTWARE);
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd < 0) {
+            __atomic_store_n(&perf_errno[e], errno, __ATOMIC_RELAXED);
+            continue;
+        }
+        my_stats->perf_fd[e] = fd;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/**
+ * Stop and read this thread's counters, scaling for multiplexing
+ */
+void perf_stop(void) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        int fd = my_stats->perf_fd[e];
+        if (fd < 0) {
+            continue;
+        }
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        unsigned long long v[3];  // value, time enabled, time running
+        if (read(fd, v, sizeof(v)) == sizeof(v) && v[2] > 0) {
+            my_stats->perf_count[e] = (long)((double)v[0] * v[1] / v[2]);
+            my_stats->perf_valid[e] = 1;
+        }
+        close(fd);
+        my_stats->perf_fd[e] = -1;
+    }
+}
+
+/**
+ * Print per-item counter averages for producers and consumers
+ */
+void print_perf_stats(void) {
+    static const char *names[PERF_EVENTS] = {
+        "cycles", "instructions", "L1D misses", "LLC misses", "context switches"
+    };
+    long count[2][PERF_EVENTS] = {{0}};
+    int valid[2][PERF_EVENTS] = {{0}};
+    long items[2] = {0, 0};
+    
+    for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+        int r = (ts->role == 'P') ? 0 : 1;
+        items[r] += (r == 0) ? ts->produced : ts->consumed;
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            if (ts->perf_valid[e]) {
+                count[r][e] += ts->perf_count[e];
+                valid[r][e] = 1;
+            }
+        }
+    }
+    printf("Per-item counters (--perf):\n");
+    for (int r = 0; r < 2; r++) {
+        printf("  %s:", r ? "Consumers" : "Producers");
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            if (valid[r][e] && items[r] > 0) {
+                printf(" %s %.2f", names[e], (double)count[r][e] / items[r]);
+            } else {
+                printf(" %s n/a", names[e]);
+            }
+            printf(e < PERF_EVENTS - 1 ? "," : "");
+        }
+        if (valid[r][PERF_CYCLES] && valid[r][PERF_INSTRUCTIONS] && count[r][PERF_CYCLES] > 0) {
+            printf(" (IPC %.2f)", (double)count[r][PERF_INSTRUCTIONS] / count[r][PERF_CYCLES]);
+        }
+        printf("\n");
+    }
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        if (perf_errno[e] != 0 && !valid[0][e] && !valid[1][e]) {
+            printf("  %s unavailable: %s\n", names[e], strerror(perf_errno[e]));
+        }
+    }
+}
+
+/**
+ * Sum every thread's payload cache counters, recycle latencies and check
+ * failures (--payload)
+ */
+void sum_payload_stats(payload_cache *total, histogram *recycle, long *recycle_ns, long *errors) {
+    memset(total, 0, sizeof(*total));
+    memset(recycle, 0, sizeof(*recycle));
+    *recycle_ns = 0;
+    *errors = 0;
+    for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+        total->allocs += ts->pool_cache.allocs;
+        total->hits += ts->pool_cache.hits;
+        total->refills += ts->pool_cache.refills;
+        total->releases += ts->pool_cache.releases;
+        total->spills += ts->pool_cache.spills;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            recycle->count[b] += ts->recycle.count[b];
+        }
+        *recycle_ns += ts->recycle_ns;
+        *errors += ts->payload_errors;
+    }
+}
+
+/**
+ * Print the payload pool summary: how often a thread's cache served an
+ * allocation, and how long buffers sat free between release and reuse
+ */
+void print_payload_stats(void) {
+    payload_cache total;
+    histogram recycle;
+    long recycle_ns, errors, reused = 0;
+    
+    sum_payload_stats(&total, &recycle, &recycle_ns, &errors);
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        reused += recycle.count[b];
+    }
+    printf("Payload pool: %d buffers of %zu bytes, cache hit rate %.1f%% "
+           "(%ld allocs, %ld refills, %ld waits), %ld releases with %ld spills\n",
+           pool.count, pool.size, total.allocs > 0 ? 100.0 * total.hits / total.allocs : 0.0,
+           total.allocs, total.refills, pool.waits, total.releases, total.spills);
+    printf("Payload recycle latency: %ld reuses, avg %.6f s, p50 %.6f s, p99 %.6f s; "
+           "%ld payload check failure(s)\n",
+           reused, reused > 0 ? recycle_ns / 1e9 / reused : 0.0,
+           hist_percentile(&recycle, 0.50), hist_percentile(&recycle, 0.99), errors);
+}
+
+/**
+ * Is this item in the traced sample? (both sides decide alike from its seq)
+ * Never true on a thread whose trace ring could not be allocated.
+ */
+int trace_wanted(const item *it) {
+    return my_stats->trace != NULL && it->seq % trace_sample == 0;
+}
+
+/**
+ * Append one event to this thread's trace ring, overwriting the oldest
+ */
+void trace_record(int kind, const item *it, long t0, long t1, long t2,
+                  long slot_wait_ns, long mutex_wait_ns) {
+    if (my_stats->trace == NULL) {
+        return;
+    }
+    trace_event *ev = &my_stats->trace[my_stats->trace_count % trace_ring_size];
+    ev->kind = kind;
+    ev->t0 = t0;
+    ev->t1 = t1;
+    ev->t2 = t2;
+    ev->slot_wait_ns = slot_wait_ns;
+    ev->mutex_wait_ns = mutex_wait_ns;
+    ev->producer_id = it->producer_id;
+    ev->seq = it->seq;
+    ev->priority = it->priority;
+    my_stats->trace_count++;
+}
+
+/**
+ * Dump every thread's trace ring as Chrome trace-event JSON (Perfetto,
+ * chrome://tracing). Per traced item: an "enqueue" span on the producer, an
+ * async "queued" span from inserted to removed (matched by item id), and
+ * "dequeue" + "consume" spans on the consumer. Spans carry how long the
+ * step was blocked on the slot semaphore and on the mutex.
+ * Returns 0 on success, -1 if the file cannot be written.
+ */
+int write_trace(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+               "\"args\": {\"name\": \"producer_consumer\"}}");
+    for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+        int tid = (ts->role == 'P') ? ts->id : 1000 + ts->id;
+        fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                   "\"args\": {\"name\": \"%c%d\"}}", tid, ts->role, ts->id);
+        if (ts->trace == NULL) {
+            continue;
+        }
+        long first = (ts->trace_count > trace_ring_size) ? ts->trace_count - trace_ring_size : 0;
+        for (long i = first; i < ts->trace_count; i++) {
+            const trace_event *ev = &ts->trace[i % trace_ring_size];
+            double t0 = (ev->t0 - trace_epoch_ns) / 1000.0;  // trace-event ts is in us
+            double t1 = (ev->t1 - trace_epoch_ns) / 1000.0;
+            double t2 = (ev->t2 - trace_epoch_ns) / 1000.0;
+            long item_id = ((long)ev->producer_id << 32) | (unsigned int)ev->seq;
+            const char *slot_name = (ev->kind == TRACE_ENQUEUE) ? "slot_wait_us" : "item_wait_us";
+            
+            fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                       "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"item\": \"P%d#%d\", "
+                       "\"priority\": %d, \"%s\": %.3f, \"mutex_wait_us\": %.3f}}",
+                    ev->kind == TRACE_ENQUEUE ? "enqueue" : "dequeue", tid, t0, t1 - t0,
+                    ev->producer_id, ev->seq, ev->priority, slot_name,
+                    ev->slot_wait_ns / 1000.0, ev->mutex_wait_ns / 1000.0);
+            fprintf(f, ",\n{\"name\": \"queued\", \"cat\": \"item\", \"ph\": \"%s\", "
+                       "\"id\": \"0x%lx\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f}",
+                    ev->kind == TRACE_ENQUEUE ? "b" : "e", item_id, tid, t1);
+            if (ev->kind == TRACE_DEQUEUE) {
+                fprintf(f, ",\n{\"name\": \"consume\", \"ph\": \"X\", \"pid\": 1, "
+                           "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                           "\"args\": {\"item\": \"P%d#%d\"}}",
+                        tid, t1, t2 - t1, ev->producer_id, ev->seq);
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Open the exporter's listening socket, or return -1 with an error printed
+ */
+int open_exporter_socket(void) {
+    int fd;
+    if (prom_socket_path != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(prom_socket_path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Error: socket path too long: %s\n", prom_socket_path);
+            return -1;
+        }
+        strcpy(addr.sun_path, prom_socket_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("Error: exporter socket");
+            return -1;
+        }
+        unlink(prom_socket_path);  // stale socket from an earlier run
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            perror("Error: exporter bind");
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(prom_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("Error: exporter socket");
+            return -1;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            perror("Error: exporter bind");
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, 8) != 0) {
+        perror("Error: exporter listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Prometheus exporter thread (--prom-socket / --prom-port)
+ * Serves the text exposition format to any "GET /metrics" over HTTP/1.0, one
+ * request per connection. Everything comes from the per-thread stat blocks
+ * and lock-free depth reads, so scrapes never touch the hot-path locks.
+ */
+void *exporter(void *param) {
+    (void)param;
+    while (!__atomic_load_n(&exporter_stop, __ATOMIC_SEQ_CST)) {
+        struct pollfd pfd = {exporter_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;  // timeout: re-check the stop flag
+        }
+        int client = accept(exporter_fd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        char request[1024];
+        ssize_t n = read(client, request, sizeof(request) - 1);
+        request[n > 0 ? n : 0] = '\0';
+        
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *mem = open_memstream(&body, &body_len);
+        const char *status = "200 OK";
+        if (strncmp(request, "GET /metrics", 12) == 0) {
+            write_prometheus(mem);
+        } else {
+            status = "404 Not Found";
+            fprintf(mem, "try GET /metrics\n");
+        }
+        fclose(mem);
+        
+        char header[256];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 %s\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\n\r\n", status, body_len);
+        send(client, header, header_len, MSG_NOSIGNAL);
+        send(client, body, body_len, MSG_NOSIGNAL);
+        free(body);
+        close(client);
+    }
+    
+    pthread_exit(NULL);
+}
+
+/**
+ * Write the current metrics in Prometheus text exposition format
+ */
+void write_prometheus(FILE *f) {
+    static const char *kind_names[WAIT_KINDS] = {"empty", "full", "mutex", "ring"};
+    static const char *role_names[2] = {"producer", "consumer"};
+    stats_snapshot snap;
+    take_snapshot(&snap);
+    
+    fprintf(f, "# HELP pc_items_produced_total Items inserted by producers.\n");
+    fprintf(f, "# TYPE pc_items_produced_total counter\n");
+    fprintf(f, "pc_items_produced_total %ld\n", snap.produced);
+    fprintf(f, "# HELP pc_items_consumed_total Items consumed.\n");
+    fprintf(f, "# TYPE pc_items_consumed_total counter\n");
+    fprintf(f, "pc_items_consumed_total %ld\n", snap.consumed);
+    fprintf(f, "# HELP pc_queue_depth Items currently queued.\n");
+    fprintf(f, "# TYPE pc_queue_depth gauge\n");
+    fprintf(f, "pc_queue_depth %d\n", queue_depth());
+    fprintf(f, "# HELP pc_queue_capacity Most items the queue can hold.\n");
+    fprintf(f, "# TYPE pc_queue_capacity gauge\n");
+    fprintf(f, "pc_queue_capacity %d\n", queue_capacity());
+    fprintf(f, "# HELP pc_blocked_threads Threads currently blocked in a wait.\n");
+    fprintf(f, "# TYPE pc_blocked_threads gauge\n");
+    fprintf(f, "pc_blocked_threads{role=\"producer\"} %d\n", snap.blocked_producers);
+    fprintf(f, "pc_blocked_threads{role=\"consumer\"} %d\n", snap.blocked_consumers);
+    
+    fprintf(f, "# HELP pc_waits_total Semaphore/ring acquisitions by outcome.\n");
+    fprintf(f, "# TYPE pc_waits_total counter\n");
+    for (int r = 0; r < 2; r++) {
+        for (int k = 0; k < WAIT_KINDS; k++) {
+            fprintf(f, "pc_waits_total{role=\"%s\",kind=\"%s\",outcome=\"fast\"} %ld\n",
+                    role_names[r], kind_names[k], snap.fast_acquires[r][k]);
+            fprintf(f, "pc_waits_total{role=\"%s\",kind=\"%s\",outcome=\"blocked\"} %ld\n",
+                    role_names[r], kind_names[k], snap.waits[r][k]);
+        }
+    }
+    fprintf(f, "# HELP pc_wait_seconds_total Time spent blocked.\n");
+    fprintf(f, "# TYPE pc_wait_seconds_total counter\n");
+    for (int r = 0; r < 2; r++) {
+        for (int k = 0; k < WAIT_KINDS; k++) {
+            fprintf(f, "pc_wait_seconds_total{role=\"%s\",kind=\"%s\"} %.9f\n",
+                    role_names[r], kind_names[k], snap.wait_ns[r][k] / 1e9);
+        }
+    }
+    
+    fprintf(f, "# HELP pc_latency_seconds Produce-to-consume latency.\n");
+    fprintf(f, "# TYPE pc_latency_seconds histogram\n");
+    long cumulative = 0;
+    for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+        cumulative += snap.latency.count[b];
+        fprintf(f, "pc_latency_seconds_bucket{le=\"%g\"} %ld\n", (1L << b) / 1e6, cumulative);
+    }
+    cumulative += snap.latency.count[HIST_BUCKETS - 1];  // overflow bucket
+    fprintf(f, "pc_latency_seconds_bucket{le=\"+Inf\"} %ld\n", cumulative);
+    fprintf(f, "pc_latency_seconds_sum %.9f\n", snap.latency_ns / 1e9);
+    fprintf(f, "pc_latency_seconds_count %ld\n", cumulative);
+}
+
+/**
+ * Allocate this thread's stat block and link it into the registry
+ */
+void register_thread(char role, int id) {
+    thread_stats *ts = (thread_stats *)calloc(1, sizeof(thread_stats));
+    ts->role = role;
+    ts->id = id;
+    if (trace_path != NULL) {
+        ts->trace = (trace_event *)malloc(trace_ring_size * sizeof(trace_event));
+        if (ts->trace == NULL) {
+            fprintf(stderr, "Warning: no memory for %c%d's trace ring, not tracing it\n",
+                    role, id);
+        }
+    }
+    if (verify && role == 'C') {
+        ts->seen = (uint64_t *)calloc(((long)num_producers * items_per_producer + 63) / 64,
+                                      sizeof(uint64_t));
+        ts->seen_last = (int *)malloc(num_producers * sizeof(int));
+        if (ts->seen_last == NULL) {
+            free(ts->seen);
+            ts->seen = NULL;  // every item will count as corrupt, failing the check
+        }
+        for (int p = 0; ts->seen_last != NULL && p < num_producers; p++) {
+            ts->seen_last[p] = -1;
+        }
+    }
+    ts->next = __atomic_load_n(&stats_registry, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&stats_registry, &ts->next, ts, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        // ts->next was refreshed by the failed exchange; retry
+    }
+    my_stats = ts;
+}
+
+/**
+ * Add n to a counter in this thread's own stat block
+ * Only the owner writes, so a relaxed load + store is enough; readers
+ * never see a torn value.
+ */
+void stat_add(long *counter, long n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sum every registered thread's counters (lock-free, values may be a few
+ * items apart from each other since workers keep running)
+ */
+void take_snapshot(stats_snapshot *snap) {
+    memset(snap, 0, sizeof(*snap));
+    for (thread_stats *ts = __atomic_load_n(&stats_registry, __ATOMIC_ACQUIRE);
+         ts != NULL; ts = ts->next) {
+        snap->produced += __atomic_load_n(&ts->produced, __ATOMIC_RELAXED);
+        snap->consumed += __atomic_load_n(&ts->consumed, __ATOMIC_RELAXED);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            snap->latency.count[b] += __atomic_load_n(&ts->latency.count[b], __ATOMIC_RELAXED);
+        }
+        snap->latency_ns += __atomic_load_n(&ts->latency_ns, __ATOMIC_RELAXED);
+        int r = (ts->role == 'P') ? 0 : 1;
+        for (int k = 0; k < WAIT_KINDS; k++) {
+            snap->fast_acquires[r][k] += __atomic_load_n(&ts->fast_acquires[k], __ATOMIC_RELAXED);
+            snap->waits[r][k] += __atomic_load_n(&ts->waits[k], __ATOMIC_RELAXED);
+            snap->wait_ns[r][k] += __atomic_load_n(&ts->wait_ns[k], __ATOMIC_RELAXED);
+        }
+        if (__atomic_load_n(&ts->blocked, __ATOMIC_RELAXED)) {
+            if (ts->role == 'P') {
+                snap->blocked_producers++;
+            } else {
+                snap->blocked_consumers++;
+            }
+        }
+    }
+}
+
+/**
+ * out = now - before, bucket by bucket (the interval's histogram)
+ */
+void hist_diff(histogram *out, const histogram *now, const histogram *before) {
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        out->count[b] = now->count[b] - before->count[b];
+    }
+}
+
+/**
+ * Items currently queued, for occupancy sampling (approximate, no locks)
+ */
+int queue_depth(void) {
+    if (mode != MODE_QUEUE) {
+        long depth = __atomic_load_n(&claim_seq, __ATOMIC_RELAXED) - 1 - gating_progress();
+        return (int)(depth < 0 ? 0 : depth > buffer_size ? buffer_size : depth);
+    }
+    if (policy == POLICY_KEYED) {
+        int depth = 0;
+        for (int c = 0; c < num_consumers; c++) {
+            int v;
+            sem_getvalue(&lanes[c].q.full, &v);
+            depth += v;
+        }
+        return depth / num_consumers;  // mean lane depth, comparable to buffer_size
+    }
+    int depth = __atomic_load_n(&buffer_count, __ATOMIC_RELAXED);
+    return (depth > queue_capacity()) ? queue_capacity() : depth;
+}
+
+/**
+ * Most items queue_depth() can report: DRR bounds each level separately, so
+ * its queue holds up to num_levels * buffer_size
+ */
+int queue_capacity(void) {
+    if (mode == MODE_QUEUE && policy == POLICY_DRR) {
+        return num_levels * buffer_size;
+    }
+    return buffer_size;
+}
+
+/**
+ * Slot of a sequence number or unwrapped index in a buffer_size ring: a mask
+ * for power-of-two sizes, a division otherwise
+ */
+int ring_slot(long seq) {
+    if (buffer_mask >= 0) {
+        return (int)(seq & buffer_mask);
+    }
+    return (int)(seq % buffer_size);
+}
+
+/**
+ * sem_wait() that flags this thread as blocked while it waits and records,
+ * per wait kind, fast acquisitions, blocking waits and the time blocked
+ * The clock is only read when the fast path fails.
+ */
+void blocking_wait(sem_t *sem, int kind) {
+    if (my_stats == NULL) {
+        sem_wait(sem);
+        return;
+    }
+    if (sem_trywait(sem) == 0) {
+        stat_add(&my_stats->fast_acquires[kind], 1);  // fast path: no wait
+        return;
+    }
+    struct timespec wait_start;
+    clock_gettime(CLOCK_MONOTONIC, &wait_start);
+    __atomic_store_n(&my_stats->blocked, 1, __ATOMIC_RELAXED);
+    sem_wait(sem);
+    __atomic_store_n(&my_stats->blocked, 0, __ATOMIC_RELAXED);
+    stat_add(&my_stats->waits[kind], 1);
+    stat_add(&my_stats->wait_ns[kind], elapsed_ns(&wait_start));
+}
+
+/**
+ * Nanoseconds elapsed on the monotonic clock since from
+ */
+long elapsed_ns(const struct timespec *from) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1000000000L + (now.tv_nsec - from->tv_nsec);
+}
+
+/**
+ * Print per-thread and per-role wait statistics and name the bottleneck:
+ * the (role, wait kind) pair with the largest share of its threads' time
+ */
+void print_wait_stats(double total_time) {
+    static const char *kind_names[WAIT_KINDS] = {"empty", "full", "mutex", "ring"};
+    long fast[2][WAIT_KINDS] = {{0}}, waits[2][WAIT_KINDS] = {{0}}, ns[2][WAIT_KINDS] = {{0}};
+    int threads[2] = {0, 0};  // [0] producers, [1] consumers
+    
+    printf("Wait statistics (fast acquires / blocking waits, time blocked):\n");
+    for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+        int r = (ts->role == 'P') ? 0 : 1;
+        threads[r]++;
+        printf("  [%c%d]", ts->role, ts->id);
+        for (int k = 0; k < WAIT_KINDS; k++) {
+            fast[r][k] += ts->fast_acquires[k];
+            waits[r][k] += ts->waits[k];
+            ns[r][k] += ts->wait_ns[k];
+            if (ts->fast_acquires[k] + ts->waits[k] > 0) {
+                printf(" %s %ld/%ld %.6f s", kind_names[k], ts->fast_acquires[k],
+                       ts->waits[k], ts->wait_ns[k] / 1e9);
+            }
+        }
+        printf("\n");
+    }
+    
+    int worst_r = -1, worst_k = 0;
+    double worst_share = 0.0;
+    for (int r = 0; r < 2; r++) {
+        for (int k = 0; k < WAIT_KINDS; k++) {
+            if (fast[r][k] + waits[r][k] == 0) {
+                continue;
+            }
+            double share = (threads[r] > 0 && total_time > 0)
+                           ? ns[r][k] / 1e9 / (threads[r] * total_time) : 0.0;
+            printf("  %s on %s: %ld fast, %ld blocked, %.6f s blocked (%.1f%% of their time)\n",
+                   r ? "Consumers" : "Producers", kind_names[k], fast[r][k], waits[r][k],
+                   ns[r][k] / 1e9, share * 100);
+            if (share > worst_share) {
+                worst_share = share;
+                worst_r = r;
+                worst_k = k;
+            }
+        }
+    }
+    if (worst_r >= 0) {
+        printf("Bottleneck: %s blocked on %s (%.1f%% of their time)\n",
+               worst_r ? "consumers" : "producers", kind_names[worst_k], worst_share * 100);
+    }
+}
+
+/**
+ * Names used in the machine-readable configuration block
+ */
+const char *policy_name(void) {
+    static const char *names[] = {"priority", "edf", "levels", "drr", "keyed"};
+    return names[policy];
+}
+
+const char *mode_name(void) {
+    static const char *names[] = {"queue", "pipeline", "broadcast"};
+    return names[mode];
+}
+
+const char *arrival_name(void) {
+    static const char *names[] = {"poisson", "constant", "bursty"};
+    if (replay_path != NULL) {
+        return "replay";
+    }
+    return (arrival_rate > 0) ? names[arrival] : "closed";
+}
+
+/**
+ * Start a member: JSON writes the separator and "key": , CSV extends the path
+ */
+void mw_key(metrics_writer *w, const char *key) {
+    if (w->json) {
+        fprintf(w->f, "%s\n%*s\"%s\": ", w->first[w->depth] ? "" : ",",
+                2 * (w->depth + 1), "", key);
+        w->first[w->depth] = 0;
+    } else {
+        fprintf(w->f, "%s%s,", w->path, key);
+    }
+}
+
+/**
+ * Open a nested object under key (key NULL opens the root)
+ */
+void mw_open(metrics_writer *w, const char *key) {
+    if (key == NULL) {
+        w->depth = 0;
+        w->path[0] = '\0';
+        w->first[0] = 1;
+        w->path_len[0] = 0;
+        if (w->json) {
+            fprintf(w->f, "{");
+        } else {
+            fprintf(w->f, "key,value\n");
+        }
+        return;
+    }
+    if (w->json) {
+        mw_key(w, key);
+        fprintf(w->f, "{");
+    }
+    w->depth++;
+    w->first[w->depth] = 1;
+    w->path_len[w->depth] = strlen(w->path);
+    snprintf(w->path + w->path_len[w->depth], sizeof(w->path) - w->path_len[w->depth],
+             "%s.", key);
+}
+
+/**
+ * Close the innermost open object
+ */
+void mw_close(metrics_writer *w) {
+    if (w->json) {
+        fprintf(w->f, "\n%*s}", 2 * w->depth, "");
+    }
+    if (w->depth == 0) {
+        fprintf(w->f, w->json ? "\n" : "");
+        return;
+    }
+    w->path[w->path_len[w->depth]] = '\0';
+    w->depth--;
+}
+
+void mw_int(metrics_writer *w, const char *key, long v) {
+    mw_key(w, key);
+    fprintf(w->f, w->json ? "%ld" : "%ld\n", v);
+}
+
+void mw_num(metrics_writer *w, const char *key, double v) {
+    mw_key(w, key);
+    fprintf(w->f, w->json ? "%.9g" : "%.9g\n", v);
+}
+
+/**
+ * Write a string value: JSON escapes quotes, backslashes and control
+ * characters; CSV quotes the field (doubling quotes) if it needs it
+ */
+void mw_str(metrics_writer *w, const char *key, const char *v) {
+    mw_key(w, key);
+    if (w->json) {
+        fputc('"', w->f);
+        for (const unsigned char *c = (const unsigned char *)v; *c != '\0'; c++) {
+            if (*c == '"' || *c == '\\') {
+                fprintf(w->f, "\\%c", *c);
+            } else if (*c == '\n') {
+                fputs("\\n", w->f);
+            } else if (*c == '\t') {
+                fputs("\\t", w->f);
+            } else if (*c < 0x20) {
+                fprintf(w->f, "\\u%04x", *c);
+            } else {
+                fputc(*c, w->f);
+            }
+        }
+        fputc('"', w->f);
+    } else if (strpbrk(v, ",\"\r\n") != NULL) {
+        fputc('"', w->f);
+        for (const char *c = v; *c != '\0'; c++) {
+            if (*c == '"') {
+                fputc('"', w->f);
+            }
+            fputc(*c, w->f);
+        }
+        fputs("\"\n", w->f);
+    } else {
+        fprintf(w->f, "%s\n", v);
+    }
+}
+
+/**
+ * qsort order of thread_stats pointers: by role, then by id
+ */
+int compare_threads(const void *a, const void *b) {
+    const thread_stats *x = *(thread_stats *const *)a;
+    const thread_stats *y = *(thread_stats *const *)b;
+    if (x->role != y->role) {
+        return (x->role < y->role) ? -1 : 1;
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+/**
+ * Write the full metrics tree (schema METRICS_SCHEMA_VERSION)
+ * Keys are stable and every histogram bucket is always present, so two runs
+ * can be diffed line by line; new keys are only ever added.
+ */
+void write_metrics(FILE *f, int json, double total_time) {
+    static const char *kind_names[WAIT_KINDS] = {"empty", "full", "mutex", "ring"};
+    metrics_writer w;
+    char key[64];
+    stats_snapshot snap;
+    take_snapshot(&snap);
+    
+    memset(&w, 0, sizeof(w));
+    w.f = f;
+    w.json = json;
+    mw_open(&w, NULL);
+    mw_int(&w, "schema_version", METRICS_SCHEMA_VERSION);
+    
+    mw_open(&w, "build");
+    mw_str(&w, "compiler", __VERSION__);
+    mw_str(&w, "date", __DATE__ " " __TIME__);
+#ifdef __OPTIMIZE__
+    mw_int(&w, "optimized", 1);
+#else
+    mw_int(&w, "optimized", 0);
+#endif
+    mw_close(&w);
+    
+    mw_open(&w, "config");
+    mw_int(&w, "producers", num_producers);
+    mw_int(&w, "consumers", num_consumers);
+    mw_int(&w, "buffer_size", buffer_size);
+    mw_str(&w, "index_wrap", buffer_mask >= 0 ? "mask" : "modulo");
+    mw_int(&w, "items_per_producer", items_per_producer);
+    mw_str(&w, "mode", mode_name());
+    mw_str(&w, "policy", policy_name());
+    mw_int(&w, "levels", num_levels);
+    mw_int(&w, "aging_ms", aging_ms);
+    mw_int(&w, "deadline_urgent_ms", deadline_urgent_ms);
+    mw_int(&w, "deadline_normal_ms", deadline_normal_ms);
+    mw_int(&w, "stages", mode == MODE_QUEUE ? 0 : num_stages);
+    mw_int(&w, "min_consumers", max_consumers > 0 ? min_consumers : 0);
+    mw_int(&w, "max_consumers", max_consumers);
+    mw_str(&w, "arrival", arrival_name());
+    mw_num(&w, "rate", arrival_rate);
+    mw_int(&w, "producer_spin_ns", producer_work.spin_ns);
+    mw_int(&w, "producer_touch_kb", producer_work.touch_kb);
+    mw_int(&w, "producer_sleep_us", producer_work.sleep_us);
+    mw_int(&w, "consumer_spin_ns", consumer_work.spin_ns);
+    mw_int(&w, "consumer_touch_kb", consumer_work.touch_kb);
+    mw_int(&w, "consumer_sleep_us", consumer_work.sleep_us);
+    mw_int(&w, "payload_bytes", payload_bytes);
+    mw_str(&w, "clock", item_clock_source == ITEM_CLOCK_TSC ? "tsc" : "gettimeofday");
+    mw_close(&w);
+    
+    mw_open(&w, "totals");
+    mw_int(&w, "produced", total_produced);
+    mw_int(&w, "consumed", total_consumed);
+    mw_num(&w, "time_s", total_time);
+    mw_num(&w, "throughput", total_time > 0 ? total_consumed / total_time : 0.0);
+    mw_num(&w, "avg_latency_s", total_consumed > 0 ? total_latency / total_consumed : 0.0);
+    mw_num(&w, "p50_latency_s", hist_percentile(&snap.latency, 0.50));
+    mw_num(&w, "p90_latency_s", hist_percentile(&snap.latency, 0.90));
+    mw_num(&w, "p99_latency_s", hist_percentile(&snap.latency, 0.99));
+    mw_num(&w, "max_lateness_s", max_lateness);
+    mw_int(&w, "order_violations", order_violations);
+    mw_close(&w);
+    
+    if (verify) {
+        mw_open(&w, "verify");
+        mw_int(&w, "expected", total_produced);
+        mw_int(&w, "lost", verify_lost);
+        mw_int(&w, "duplicated", verify_dups);
+        mw_int(&w, "corrupt", verify_corrupt);
+        mw_int(&w, "reordered", verify_reorders);
+        mw_close(&w);
+    }
+    
+    if (arrival_rate > 0 || replay_path != NULL) {
+        mw_open(&w, "open_loop");
+        mw_num(&w, "offered_rate", last_arrival > 0 ? total_produced / last_arrival : 0.0);
+        mw_int(&w, "late_sends", late_sends);
+        mw_num(&w, "p99_send_lag_s", fmin(hist_percentile(&send_lag_hist, 0.99), max_send_lag));
+        mw_num(&w, "max_send_lag_s", max_send_lag);
+        mw_close(&w);
+    }
+    
+    mw_open(&w, "latency_histogram_us");  // bucket "lt_N" counts latencies below N us
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        snprintf(key, sizeof(key), "lt_%ld", 1L << b);
+        mw_int(&w, key, snap.latency.count[b]);
+    }
+    mw_close(&w);
+    
+    mw_open(&w, "priorities");
+    for (int c = num_levels - 1; c >= 0; c--) {
+        mw_open(&w, priority_label(c, key, sizeof(key)));
+        mw_int(&w, "consumed", class_consumed[c]);
+        mw_num(&w, "avg_latency_s",
+               class_consumed[c] > 0 ? class_total_latency[c] / class_consumed[c] : 0.0);
+        mw_num(&w, "max_latency_s", class_max_latency[c]);
+        mw_int(&w, "deadline_misses", deadline_misses[c]);
+        if (policy == POLICY_DRR) {
+            mw_int(&w, "weight", level_weight[c]);
+            mw_int(&w, "saturated_dequeues", drr_saturated[c]);
+        }
+        mw_close(&w);
+    }
+    mw_close(&w);
+    
+    // The registry is in registration order, which varies run to run
+    int thread_count = 0;
+    for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+        thread_count++;
+    }
+    thread_stats **sorted = (thread_stats **)malloc((thread_count + 1) * sizeof(thread_stats *));
+    if (sorted == NULL) {
+        thread_count = 0;
+    } else {
+        int n = 0;
+        for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+            sorted[n++] = ts;
+        }
+        qsort(sorted, thread_count, sizeof(thread_stats *), compare_threads);
+    }
+    mw_open(&w, "threads");
+    for (int t = 0; t < thread_count; t++) {
+        thread_stats *ts = sorted[t];
+        snprintf(key, sizeof(key), "%c%d", ts->role, ts->id);
+        mw_open(&w, key);
+        mw_int(&w, "produced", ts->produced);
+        mw_int(&w, "consumed", ts->consumed);
+        mw_int(&w, "work_ns", ts->work_ns);
+        for (int k = 0; k < WAIT_KINDS; k++) {
+            mw_open(&w, kind_names[k]);
+            mw_int(&w, "fast", ts->fast_acquires[k]);
+            mw_int(&w, "blocked", ts->waits[k]);
+            mw_num(&w, "blocked_s", ts->wait_ns[k] / 1e9);
+            mw_close(&w);
+        }
+        mw_close(&w);
+    }
+    mw_close(&w);
+    free(sorted);
+    
+    if (mode != MODE_QUEUE) {
+        mw_open(&w, mode == MODE_PIPELINE ? "stages" : "groups");
+        for (int t = 0; t < num_stages; t++) {
+            snprintf(key, sizeof(key), "%d", t + 1);
+            mw_open(&w, key);
+            mw_int(&w, "items", stage_items[t]);
+            mw_num(&w, "avg_latency_s",
+                   stage_items[t] > 0 ? stage_total_latency[t] / stage_items[t] : 0.0);
+            mw_num(&w, "max_latency_s", stage_max_latency[t]);
+            mw_num(&w, "avg_depth",
+                   stage_items[t] > 0 ? (double)stage_depth_sum[t] / stage_items[t] : 0.0);
+            mw_int(&w, "max_depth", stage_depth_max[t]);
+            mw_close(&w);
+        }
+        mw_close(&w);
+    } else if (policy == POLICY_KEYED) {
+        mw_open(&w, "lanes");
+        for (int c = 0; c < num_consumers; c++) {
+            snprintf(key, sizeof(key), "%d", c + 1);
+            mw_int(&w, key, lanes[c].consumed);
+        }
+        mw_close(&w);
+    }
+    if (perf_enabled) {
+        static const char *perf_keys[PERF_EVENTS] = {
+            "cycles", "instructions", "l1d_misses", "llc_misses", "context_switches"
+        };
+        mw_open(&w, "perf_per_item");  // -1 where the counter was unavailable
+        for (int r = 0; r < 2; r++) {
+            long count[PERF_EVENTS] = {0}, items = 0;
+            int valid[PERF_EVENTS] = {0};
+            for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+                if ((ts->role == 'P') != (r == 0)) {
+                    continue;
+                }
+                items += (r == 0) ? ts->produced : ts->consumed;
+                for (int e = 0; e < PERF_EVENTS; e++) {
+                    count[e] += ts->perf_count[e];
+                    valid[e] |= ts->perf_valid[e];
+                }
+            }
+            mw_open(&w, r ? "consumers" : "producers");
+            for (int e = 0; e < PERF_EVENTS; e++) {
+                mw_num(&w, perf_keys[e], (valid[e] && items > 0) ? (double)count[e] / items : -1);
+            }
+            mw_close(&w);
+        }
+        mw_close(&w);
+    }
+    if (payload_bytes > 0) {
+        payload_cache total;
+        histogram recycle;
+        long recycle_ns, errors, reused = 0;
+        sum_payload_stats(&total, &recycle, &recycle_ns, &errors);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            reused += recycle.count[b];
+        }
+        mw_open(&w, "payload");
+        mw_int(&w, "bytes", payload_bytes);
+        mw_int(&w, "buffers", pool.count);
+        mw_int(&w, "allocs", total.allocs);
+        mw_int(&w, "cache_hits", total.hits);
+        mw_num(&w, "hit_rate", total.allocs > 0 ? (double)total.hits / total.allocs : 0.0);
+        mw_int(&w, "refills", total.refills);
+        mw_int(&w, "waits", pool.waits);
+        mw_int(&w, "releases", total.releases);
+        mw_int(&w, "spills", total.spills);
+        mw_int(&w, "reuses", reused);
+        mw_num(&w, "avg_recycle_s", reused > 0 ? recycle_ns / 1e9 / reused : 0.0);
+        mw_num(&w, "p50_recycle_s", hist_percentile(&recycle, 0.50));
+        mw_num(&w, "p99_recycle_s", hist_percentile(&recycle, 0.99));
+        mw_int(&w, "check_failures", errors);
+        mw_close(&w);
+    }
+    if (max_consumers > 0) {
+        mw_open(&w, "autoscaling");
+        mw_int(&w, "scale_ups", scale_ups);
+        mw_int(&w, "scale_downs", scale_downs);
+        mw_int(&w, "peak_consumers", peak_consumers);
+        mw_close(&w);
+    }
+    mw_close(&w);
+}
+
+/**
+ * Log2 microsecond bucket of a duration (in seconds)
+ */
+int hist_bucket(double seconds) {
+    long us = (long)(seconds * 1000000.0);
+    int b = 0;
+    while (us > 0 && b < HIST_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
 
-/* Semaphores  */
-sem_t mutex;  // initialized to 1 (mutual exclusion)
-sem_t empty;  // initialized to n (empty slots)
-sem_t full;   // initialized to 0 (full slots)
+/**
+ * Record a duration (in seconds) in a log2 microsecond histogram
+ */
+void hist_record(histogram *h, double seconds) {
+    h->count[hist_bucket(seconds)]++;
+}
 
-/* Global variables */
-int num_producers;
-int num_consumers;
-int total_produced = 0;
-int total_consumed = 0;
+/**
+ * Upper bound (in seconds) of the bucket holding the p-quantile, 0 if empty
+ */
+double hist_percentile(const histogram *h, double p) {
+    long total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        total += h->count[b];
+    }
+    if (total == 0) {
+        return 0.0;
+    }
+    long rank = (long)(p * total);
+    long seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen > rank) {
+            return (1L << b) / 1000000.0;
+        }
+    }
+    return (1L << (HIST_BUCKETS - 1)) / 1000000.0;
+}
 
-/* Metrics for bonus feature */
-struct timeval start_time, end_time;
-double total_latency = 0.0;
-pthread_mutex_t stats_lock;
+/**
+ * Print the non-empty buckets of a histogram, one per line
+ */
+void print_histogram(const char *label, const histogram *h) {
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (h->count[b] == 0) {
+            continue;
+        }
+        long lo = (b == 0) ? 0 : 1L << (b - 1);
+        printf("  %s [%ld us, %ld us): %ld\n", label, lo, 1L << b, h->count[b]);
+    }
+}
 
-/* Function prototypes */
-void *producer(void *param);
-void *consumer(void *param);
-void insert_item(item next_produced);
-item remove_item(void);
+/**
+ * Print command-line usage
+ */
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <num_producers> <num_consumers> <buffer_size> [options]\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --items=N      items generated by each producer (default %d)\n",
+            ITEMS_PER_PRODUCER);
+    fprintf(stderr, "  --quiet        do not print a line per produced/consumed item\n");
+    fprintf(stderr, "  --sample-ms=N  print live interval metrics every N ms\n");
+    fprintf(stderr, "  --sample-format=F  csv (default) or json (one object per line)\n");
+    fprintf(stderr, "  --sample-out=PATH  write samples to PATH instead of stdout\n");
+    fprintf(stderr, "  --metrics-format=F also emit the metrics as json or csv\n");
+    fprintf(stderr, "  --verify           check every item is consumed exactly once (exit 1 if not)\n");
+    fprintf(stderr, "  --perf             count cycles, instructions, cache misses and context\n");
+    fprintf(stderr, "                     switches per thread with perf_event_open\n");
+    fprintf(stderr, "  --trace=PATH       record per-item trace events, dump Chrome trace JSON\n");
+    fprintf(stderr, "  --trace-sample=N   trace one item in N per producer (default 1)\n");
+    fprintf(stderr, "  --trace-ring=N     trace events kept per thread (default %d)\n",
+            TRACE_RING_DEFAULT);
+    fprintf(stderr, "  --prom-socket=PATH serve Prometheus metrics on a Unix socket\n");
+    fprintf(stderr, "  --prom-port=N      serve Prometheus metrics on 127.0.0.1:N\n");
+    fprintf(stderr, "  --metrics-out=PATH write json/csv metrics to PATH instead of stdout\n");
+    fprintf(stderr, "  --rate=R       open loop: R items/s over all producers, latency measured\n");
+    fprintf(stderr, "                 from each item's scheduled send time\n");
+    fprintf(stderr, "  --arrival=A    open-loop arrivals: poisson (default), constant or bursty\n");
+    fprintf(stderr, "  --burst-on-ms=N  --burst-off-ms=N  bursty on/off windows (default 10/40)\n");
+    fprintf(stderr, "  --record=PATH  save every arrival (time, priority, value, size) to PATH\n");
+    fprintf(stderr, "  --replay=PATH  re-issue a recording open loop instead of generating items\n");
+    fprintf(stderr, "  --replay-speed=F  replay F times faster than recorded (default 1.0)\n");
+    fprintf(stderr, "  --clock=C          item timestamps: gettimeofday (default) or tsc\n");
+    fprintf(stderr, "  --round-pow2       round buffer_size up to a power of two (mask, not %%)\n");
+    fprintf(stderr, "  --payload=BYTES    give each item a pooled payload buffer, passed by handle\n");
+    fprintf(stderr, "  --pool-buffers=N   payload buffers (default: the smallest pool that never blocks)\n");
+    fprintf(stderr, "  --producer-work=W  --consumer-work=W  synthetic cost per item, W is a\n");
+    fprintf(stderr, "                 list of spin:<ns>,sleep:<us>,touch:<KB>,dist:fixed|exp|uniform\n");
+    fprintf(stderr, "  --aging-ms=N   raise a queued item's priority by one level every N ms\n");
+    fprintf(stderr, "                 (--policy=priority only)\n");
+    fprintf(stderr, "  --policy=P     dequeue policy: priority (default), edf, levels, drr or keyed\n");
+    fprintf(stderr, "  --levels=N     number of priority levels, 2..%d (default 2)\n", MAX_LEVELS);
+    fprintf(stderr, "  --weights=W0,W1,...  DRR weight per level, lowest first (default 1 each)\n");
+    fprintf(stderr, "  --mode=M       queue (default), pipeline (num_consumers workers per stage)\n");
+    fprintf(stderr, "                 or broadcast (each consumer is a group that sees every item)\n");
+    fprintf(stderr, "  --min-consumers=N  --max-consumers=N  elastic consumer pool bounds\n");
+    fprintf(stderr, "                 (autoscaling is enabled by --max-consumers; queue mode only)\n");
+    fprintf(stderr, "  --scale-interval-ms=N  autoscaler sampling period (default 100)\n");
+    fprintf(stderr, "  --target-p99-ms=N      autoscaler latency target (default 10)\n");
+    fprintf(stderr, "  --stages=N     pipeline stages, 2..%d (default 3: enrich, aggregate, sink)\n",
+            MAX_STAGES);
+    fprintf(stderr, "  --deadline-urgent-ms=N   relative deadline of URGENT items (default 5)\n");
+    fprintf(stderr, "  --deadline-normal-ms=N   relative deadline of NORMAL items (default 500)\n");
+}
 
 /**
- * Producer thread implementation
+ * Return the value of arg if it is "--name=value", otherwise NULL
  */
-void *producer(void *param) {
-    int id = *((int *)param);
-    free(param);
-    
-    unsigned int seed = time(NULL) + id;
-    
-    for (int i = 0; i < ITEMS_PER_PRODUCER; i++) {
-        item next_produced;
-        
-        /* produce an item in next_produced */
-        next_produced.value = rand_r(&seed) % 1000 + 1;
-        next_produced.priority = (rand_r(&seed) % 100 < 25) ? 1 : 0;  // 25% urgent
-        gettimeofday(&next_produced.timestamp, NULL);
-        
-        /* insert item into buffer */
-        insert_item(next_produced);
-        
-        pthread_mutex_lock(&stats_lock);
-        total_produced++;
-        pthread_mutex_unlock(&stats_lock);
-        
-        printf("[P%d] Produced: %d (Priority: %s)\n", 
-               id, next_produced.value,
-               next_produced.priority ? "URGENT" : "NORMAL");
+const char *option_value(const char *arg, const char *name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+        return arg + len + 1;
     }
-    
-    printf("[P%d] Finished\n", id);
-    pthread_exit(NULL);
+    return NULL;
 }
 
 /**
- * Consumer thread implementation
+ * Parse a comma-separated list of positive DRR weights, lowest level first
+ * Returns 0 on success, -1 on an invalid list
  */
-void *consumer(void *param) {
-    int id = *((int *)param);
-    free(param);
-    
-    while (1) {
-        item next_consumed;
-        
-        /* remove an item from buffer to next_consumed */
-        next_consumed = remove_item();
-        
-        /* check for poison pill */
-        if (next_consumed.value == POISON_PILL) {
-            printf("[C%d] Received poison pill. Terminating.\n", id);
-            break;
+int parse_weights(const char *list) {
+    int l = 0;
+    const char *p = list;
+    while (*p != '\0') {
+        char *end;
+        long w = strtol(p, &end, 10);
+        if (end == p || w <= 0 || w > INT_MAX || l >= MAX_LEVELS) {
+            return -1;
         }
-        
-        /* calculate latency (bonus feature) */
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        double latency = (now.tv_sec - next_consumed.timestamp.tv_sec) +
-                        (now.tv_usec - next_consumed.timestamp.tv_usec) / 1000000.0;
-        
-        pthread_mutex_lock(&stats_lock);
-        total_consumed++;
-        total_latency += latency;
-        pthread_mutex_unlock(&stats_lock);
-        
-        /* consume the item in next_consumed */
-        printf("[C%d] Consumed: %d (Priority: %s, Latency: %.6f sec)\n",
-               id, next_consumed.value,
-               next_consumed.priority ? "URGENT" : "NORMAL",
-               latency);
+        level_weight[l++] = (int)w;
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
     }
-    
-    pthread_exit(NULL);
+    return (l > 0) ? 0 : -1;
 }
 
 /**
- * Insert item into buffer
+ * Parse a work model: comma-separated key:value pairs out of spin:<ns>,
+ * sleep:<us>, touch:<KB> and dist:fixed|exp|uniform, e.g. "spin:20000,dist:exp"
+ * Returns 0 on success, -1 on an invalid spec
  */
-void insert_item(item next_produced) {
-    sem_wait(&empty);  // wait for empty slot
-    sem_wait(&mutex);  // enter critical section
-    
-    /* Critical Section - Add next_produced to the buffer */
-    buffer[in] = next_produced;
-    in = (in + 1) % buffer_size;  // move tail forward (circular)
-    
-    sem_post(&mutex);  // exit critical section
-    sem_post(&full);   // signal full slot
+int parse_work(const char *spec, work_model *w) {
+    const char *p = spec;
+    memset(w, 0, sizeof(*w));
+    while (*p != '\0') {
+        const char *colon = strchr(p, ':');
+        if (colon == NULL) {
+            return -1;
+        }
+        size_t key_len = colon - p;
+        const char *v = colon + 1;
+        char *end;
+        if (key_len == 4 && strncmp(p, "dist", 4) == 0) {
+            size_t len = strcspn(v, ",");
+            if (len == 5 && strncmp(v, "fixed", 5) == 0) {
+                w->dist = WORK_FIXED;
+            } else if (len == 3 && strncmp(v, "exp", 3) == 0) {
+                w->dist = WORK_EXP;
+            } else if (len == 7 && strncmp(v, "uniform", 7) == 0) {
+                w->dist = WORK_UNIFORM;
+            } else {
+                return -1;
+            }
+            end = (char *)v + len;
+        } else {
+            long n = strtol(v, &end, 10);
+            if (end == v || n < 0) {
+                return -1;
+            }
+            if (key_len == 4 && strncmp(p, "spin", 4) == 0) {
+                w->spin_ns = n;
+            } else if (key_len == 5 && strncmp(p, "sleep", 5) == 0) {
+                w->sleep_us = n;
+            } else if (key_len == 5 && strncmp(p, "touch", 5) == 0 && n <= INT_MAX / 1024) {
+                w->touch_kb = (int)n;
+            } else {
+                return -1;
+            }
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+    return 0;
 }
 
 /**
- * Remove item from buffer
- * Bonus: Priority handling - urgent items consumed before normal items
+ * Parse one --name=value option (or a bare --flag)
+ * Returns 0 on success, -1 if the option is unknown or its value is invalid
  */
-item remove_item(void) {
-    sem_wait(&full);   // wait for full slot
-    sem_wait(&mutex);  // enter critical section
-    
-    /* Critical Section - Remove item from buffer */
-    // Bonus: Priority handling via linear scan and extraction
-    int best_pos = out;  // Start with FIFO position
-    int best_priority = buffer[out].priority;
+int parse_option(const char *arg) {
+    const char *value;
     
-    // Count items in buffer for safe iteration
-    int count = 0;
-    int temp_pos = out;
-    while (temp_pos != in && count < buffer_size) {
-        count++;
-        temp_pos = (temp_pos + 1) % buffer_size;
+    if (strcmp(arg, "--quiet") == 0) {
+        quiet = 1;
+        return 0;
     }
-    
-    // Scan all items in buffer looking for highest priority (urgent = 1)
-    int current_pos = out;
-    for (int i = 0; i < count; i++) {
-        if (buffer[current_pos].priority > best_priority) {
-            best_priority = buffer[current_pos].priority;
-            best_pos = current_pos;
+    if (strcmp(arg, "--verify") == 0) {
+        verify = 1;
+        return 0;
+    }
+    if (strcmp(arg, "--round-pow2") == 0) {
+        round_pow2 = 1;
+        return 0;
+    }
+    if (strcmp(arg, "--perf") == 0) {
+        perf_enabled = 1;
+        return 0;
+    }
+    if ((value = option_value(arg, "--sample-ms")) != NULL) {
+        sample_ms = atoi(value);
+        return (sample_ms > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--sample-format")) != NULL) {
+        if (strcmp(value, "csv") == 0) {
+            sample_json = 0;
+        } else if (strcmp(value, "json") == 0) {
+            sample_json = 1;
+        } else {
+            return -1;
         }
-        current_pos = (current_pos + 1) % buffer_size;
+        return 0;
     }
-    
-    // Extract the best item (save it)
-    item next_consumed = buffer[best_pos];
-    
-    // If we're not taking from front, shift items forward to fill the gap
-    if (best_pos != out) {
-        int shift_pos = best_pos;
-        // Shift items from out up to best_pos forward by one position
-        while (shift_pos != out) {
-            int prev_pos = (shift_pos - 1 + buffer_size) % buffer_size;
-            buffer[shift_pos] = buffer[prev_pos];
-            shift_pos = prev_pos;
+    if ((value = option_value(arg, "--metrics-format")) != NULL) {
+        if (strcmp(value, "json") == 0) {
+            metrics_format = METRICS_JSON;
+        } else if (strcmp(value, "csv") == 0) {
+            metrics_format = METRICS_CSV;
+        } else {
+            return -1;
         }
+        return 0;
     }
-    
-    // Move out pointer forward (item removed from front)
-    out = (out + 1) % buffer_size;
-    
-    sem_post(&mutex);  // exit critical section
-    sem_post(&empty);  // signal empty slot
-    
-    return next_consumed;
+    if ((value = option_value(arg, "--trace")) != NULL) {
+        trace_path = value;
+        return 0;
+    }
+    if ((value = option_value(arg, "--trace-sample")) != NULL) {
+        trace_sample = atoi(value);
+        return (trace_sample > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--trace-ring")) != NULL) {
+        trace_ring_size = atoi(value);
+        return (trace_ring_size > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--prom-socket")) != NULL) {
+        prom_socket_path = value;
+        return 0;
+    }
+    if ((value = option_value(arg, "--prom-port")) != NULL) {
+        prom_port = atoi(value);
+        return (prom_port > 0 && prom_port < 65536) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--metrics-out")) != NULL) {
+        metrics_path = value;
+        return 0;
+    }
+    if ((value = option_value(arg, "--sample-out")) != NULL) {
+        sample_path = value;
+        return 0;
+    }
+    if ((value = option_value(arg, "--items")) != NULL) {
+        items_per_producer = atoi(value);
+        return (items_per_producer > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--rate")) != NULL) {
+        arrival_rate = atof(value);
+        return (arrival_rate > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--arrival")) != NULL) {
+        if (strcmp(value, "poisson") == 0) {
+            arrival = ARRIVAL_POISSON;
+        } else if (strcmp(value, "constant") == 0) {
+            arrival = ARRIVAL_CONSTANT;
+        } else if (strcmp(value, "bursty") == 0) {
+            arrival = ARRIVAL_BURSTY;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+    if ((value = option_value(arg, "--burst-on-ms")) != NULL) {
+        burst_on_ms = atoi(value);
+        return (burst_on_ms > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--burst-off-ms")) != NULL) {
+        burst_off_ms = atoi(value);
+        return (burst_off_ms >= 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--producer-work")) != NULL) {
+        return parse_work(value, &producer_work);
+    }
+    if ((value = option_value(arg, "--consumer-work")) != NULL) {
+        return parse_work(value, &consumer_work);
+    }
+    if ((value = option_value(arg, "--record")) != NULL) {
+        record_path = value;
+        return 0;
+    }
+    if ((value = option_value(arg, "--replay")) != NULL) {
+        replay_path = value;
+        return 0;
+    }
+    if ((value = option_value(arg, "--clock")) != NULL) {
+        if (strcmp(value, "gettimeofday") == 0) {
+            item_clock_source = ITEM_CLOCK_GETTIMEOFDAY;
+        } else if (strcmp(value, "tsc") == 0) {
+            item_clock_source = ITEM_CLOCK_TSC;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+    if ((value = option_value(arg, "--payload")) != NULL) {
+        payload_bytes = atoi(value);
+        return (payload_bytes > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--pool-buffers")) != NULL) {
+        pool_buffers = atoi(value);
+        return (pool_buffers > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--replay-speed")) != NULL) {
+        replay_speed = atof(value);
+        return (replay_speed > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--aging-ms")) != NULL) {
+        aging_ms = atoi(value);
+        return (aging_ms >= 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--policy")) != NULL) {
+        if (strcmp(value, "priority") == 0) {
+            policy = POLICY_PRIORITY;
+        } else if (strcmp(value, "edf") == 0) {
+            policy = POLICY_EDF;
+        } else if (strcmp(value, "levels") == 0) {
+            policy = POLICY_LEVELS;
+        } else if (strcmp(value, "drr") == 0) {
+            policy = POLICY_DRR;
+        } else if (strcmp(value, "keyed") == 0) {
+            policy = POLICY_KEYED;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+    if ((value = option_value(arg, "--levels")) != NULL) {
+        num_levels = atoi(value);
+        return (num_levels >= 2 && num_levels <= MAX_LEVELS) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--weights")) != NULL) {
+        return parse_weights(value);
+    }
+    if ((value = option_value(arg, "--mode")) != NULL) {
+        if (strcmp(value, "queue") == 0) {
+            mode = MODE_QUEUE;
+        } else if (strcmp(value, "pipeline") == 0) {
+            mode = MODE_PIPELINE;
+        } else if (strcmp(value, "broadcast") == 0) {
+            mode = MODE_BROADCAST;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+    if ((value = option_value(arg, "--min-consumers")) != NULL) {
+        min_consumers = atoi(value);
+        return (min_consumers > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--max-consumers")) != NULL) {
+        max_consumers = atoi(value);
+        return (max_consumers > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--scale-interval-ms")) != NULL) {
+        scale_interval_ms = atoi(value);
+        return (scale_interval_ms > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--target-p99-ms")) != NULL) {
+        target_p99_ms = atoi(value);
+        return (target_p99_ms > 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--stages")) != NULL) {
+        num_stages = atoi(value);
+        return (num_stages >= 2 && num_stages <= MAX_STAGES) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--deadline-urgent-ms")) != NULL) {
+        deadline_urgent_ms = atoi(value);
+        return (deadline_urgent_ms >= 0) ? 0 : -1;
+    }
+    if ((value = option_value(arg, "--deadline-normal-ms")) != NULL) {
+        deadline_normal_ms = atoi(value);
+        return (deadline_normal_ms >= 0) ? 0 : -1;
+    }
+    return -1;
 }
 
+#ifndef PC_NO_MAIN  // bench_queue.c includes this file for the queue alone
 /**
  * Main function
  */
 int main(int argc, char *argv[]) {
     /* Validate input */
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <num_producers> <num_consumers> <buffer_size>\n", argv[0]);
+    if (argc < 4) {
+        print_usage(argv[0]);
         return 1;
     }
     
+    for (int l = 0; l < MAX_LEVELS; l++) {
+        level_weight[l] = 1;
+    }
+    
     num_producers = atoi(argv[1]);
     num_consumers = atoi(argv[2]);
     buffer_size = atoi(argv[3]);
@@ -205,26 +3290,235 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+    for (int i = 4; i < argc; i++) {
+        if (parse_option(argv[i]) != 0) {
+            fprintf(stderr, "Error: Invalid option '%s'\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    int requested_size = buffer_size;
+    if (round_pow2) {
+        int rounded = 1;
+        while (rounded < buffer_size) {
+            rounded *= 2;
+        }
+        buffer_size = rounded;
+    }
+    if ((buffer_size & (buffer_size - 1)) == 0) {
+        buffer_mask = buffer_size - 1;
+    }
+    
+    if (aging_ms > 0 && (mode != MODE_QUEUE || policy != POLICY_PRIORITY)) {
+        // Only the priority scan looks at an item's age; the others would ignore it
+        fprintf(stderr, "Error: --aging-ms needs queue mode and --policy=priority\n");
+        return 1;
+    }
+    
+    if (max_consumers > 0) {
+        if (mode != MODE_QUEUE || policy == POLICY_KEYED || min_consumers > max_consumers) {
+            fprintf(stderr, "Error: autoscaling needs queue mode, a shared buffer "
+                            "and --min-consumers <= --max-consumers\n");
+            return 1;
+        }
+        if (num_consumers < min_consumers) {
+            num_consumers = min_consumers;
+        } else if (num_consumers > max_consumers) {
+            num_consumers = max_consumers;
+        }
+    }
+    
+    if (replay_path != NULL) {
+        if (arrival_rate > 0) {
+            fprintf(stderr, "Error: --replay and --rate are exclusive\n");
+            return 1;
+        }
+        if (load_replay(replay_path) != 0) {
+            fprintf(stderr, "Error: cannot load workload recording %s\n", replay_path);
+            return 1;
+        }
+    }
+    
+    if (payload_bytes > 0) {
+        // Handles in flight: every queued item, plus each thread's cache and one in hand
+        // (DRR bounds each level separately, so every level can hold buffer_size)
+        int queued = (policy == POLICY_KEYED) ? num_consumers * buffer_size :
+                     (policy == POLICY_DRR) ? num_levels * buffer_size : buffer_size;
+        int threads = num_producers + (max_consumers > 0 ? max_consumers : num_consumers);
+        int min_buffers = payload_pool_min(queued, threads);
+        if (mode != MODE_QUEUE) {
+            fprintf(stderr, "Error: --payload needs queue mode\n");
+            return 1;
+        }
+        if (pool_buffers == 0) {
+            pool_buffers = min_buffers;
+        } else if (pool_buffers < min_buffers) {
+            fprintf(stderr, "Error: --pool-buffers must be at least %d for this configuration\n",
+                    min_buffers);
+            return 1;
+        }
+    }
+    
+    workers_per_stage = num_consumers;
+    if (mode == MODE_BROADCAST) {
+        if (num_consumers > MAX_STAGES) {
+            fprintf(stderr, "Error: broadcast mode supports at most %d consumer groups\n", MAX_STAGES);
+            return 1;
+        }
+        num_stages = num_consumers;  // one single-worker stage per group
+        workers_per_stage = 1;
+    }
+    
     printf("Configuration: %d producers, %d consumers, buffer size = %d\n",
            num_producers, num_consumers, buffer_size);
-    printf("Each producer generates %d items\n\n", ITEMS_PER_PRODUCER);
+    if (buffer_size != requested_size) {
+        printf("Buffer size rounded up from %d to a power of two\n", requested_size);
+    }
+    if (replay_path != NULL) {
+        printf("Replaying %s: %lu arrivals from %u producer(s) over %.3f s, at %.2fx speed\n",
+               replay_path, (unsigned long)replay_info.count, replay_info.producers,
+               replay_info.duration_s, replay_speed);
+    } else {
+        printf("Each producer generates %d items\n", items_per_producer);
+    }
+    if (item_clock_source == ITEM_CLOCK_TSC) {
+        if (tsc_calibrate() != 0) {
+            fprintf(stderr, "Warning: no invariant TSC, using gettimeofday() for timestamps\n");
+            item_clock_source = ITEM_CLOCK_GETTIMEOFDAY;
+        } else {
+            printf("Item clock: TSC at %.3f GHz\n", 1.0 / tsc_ns_per_tick);
+        }
+    }
+    if (payload_bytes > 0) {
+        printf("Payloads: %d bytes per item in a pool of %d buffers, passed by handle\n",
+               payload_bytes, pool_buffers);
+    }
+    if (work_enabled(&producer_work)) {
+        print_work_model("Producer", &producer_work);
+    }
+    if (work_enabled(&consumer_work)) {
+        print_work_model("Consumer", &consumer_work);
+    }
+    if (arrival_rate > 0) {
+        printf("Open loop: %s arrivals at %.1f items/s", arrival_name(), arrival_rate);
+        if (arrival == ARRIVAL_BURSTY) {
+            printf(" (on %d ms / off %d ms)", burst_on_ms, burst_off_ms);
+        }
+        printf("\n");
+    }
+    if (aging_ms > 0) {
+        printf("Priority aging: +1 level every %d ms queued\n", aging_ms);
+    }
+    if (policy == POLICY_EDF) {
+        printf("Dequeue policy: EDF (deadlines: URGENT %d ms, NORMAL %d ms)\n",
+               deadline_urgent_ms, deadline_normal_ms);
+    } else if (policy == POLICY_LEVELS) {
+        printf("Dequeue policy: %d priority levels with bitmap selection\n", num_levels);
+    } else if (policy == POLICY_DRR) {
+        printf("Dequeue policy: deficit round robin over %d levels (weights", num_levels);
+        for (int l = 0; l < num_levels; l++) {
+            printf("%s%d", l ? ":" : " ", level_weight[l]);
+        }
+        printf("), producer p feeds level (p - 1) %% %d\n", num_levels);
+        if (num_producers < num_levels && replay_path == NULL) {
+            printf("Note: fewer producers than levels, so some levels get no items\n");
+        }
+    }
+    if (mode == MODE_PIPELINE) {
+        printf("Pipeline mode: %d stages x %d worker(s) over one %d-slot sequence ring\n",
+               num_stages, num_consumers, buffer_size);
+    } else if (mode == MODE_BROADCAST) {
+        printf("Broadcast mode: %d consumer group(s) over one %d-slot sequence ring\n",
+               num_stages, buffer_size);
+    } else if (max_consumers > 0) {
+        printf("Autoscaling: %d..%d consumers, sampled every %d ms, p99 target %d ms\n",
+               min_consumers, max_consumers, scale_interval_ms, target_p99_ms);
+    }
+    if (mode == MODE_QUEUE && policy == POLICY_KEYED) {
+        printf("Dequeue policy: keyed, %d lane(s) of %d slots, producer id %% %d -> lane\n",
+               num_consumers, buffer_size, num_consumers);
+    }
+    printf("\n");
     
-    /* Allocate buffer */
-    buffer = (item *)malloc(buffer_size * sizeof(item));
-    if (buffer == NULL) {
+    /* Allocate buffer (its semaphores: mutex = 1, empty = n, full = 0) */
+    if (item_queue_init(&queue, buffer_size) != 0) {
         fprintf(stderr, "Error: Memory allocation failed\n");
         return 1;
     }
-    
-    sem_init(&mutex, 0, 1);           // binary semaphore for mutual exclusion
-    sem_init(&empty, 0, buffer_size); // counting semaphore for empty slots
-    sem_init(&full, 0, 0);            // counting semaphore for full slots
+    buffer = queue.slots;
+    if (payload_bytes > 0 && payload_pool_init(&pool, pool_buffers, payload_bytes) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    if (policy == POLICY_LEVELS || policy == POLICY_DRR) {
+        if (level_fifos_init() != 0) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return 1;
+        }
+    }
+    if (policy == POLICY_KEYED) {
+        lanes = (lane *)calloc(num_consumers, sizeof(lane));
+        if (lanes == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return 1;
+        }
+        for (int c = 0; c < num_consumers; c++) {
+            if (item_fifo_init(&lanes[c].q, buffer_size) != 0) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                return 1;
+            }
+        }
+    }
+    if (mode != MODE_QUEUE) {
+        slot_published = (long *)malloc(buffer_size * sizeof(long));
+        slot_done = (struct timeval *)malloc((size_t)buffer_size * num_stages * sizeof(struct timeval));
+        stage_cursor = (long *)malloc((size_t)num_stages * workers_per_stage * sizeof(long));
+        if (slot_published == NULL || slot_done == NULL || stage_cursor == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return 1;
+        }
+        for (int i = 0; i < buffer_size; i++) {
+            slot_published[i] = -1;
+        }
+        for (int i = 0; i < num_stages * workers_per_stage; i++) {
+            stage_cursor[i] = i % workers_per_stage - workers_per_stage;  // nothing done yet
+        }
+        pthread_mutex_init(&seq_lock, NULL);
+        pthread_cond_init(&seq_cond, NULL);
+    }
+    last_seq = (int *)calloc(num_producers + 1, sizeof(int));
     
     /* Initialize statistics mutex */
     pthread_mutex_init(&stats_lock, NULL);
     
-    /* Record start time */
+    /* Record start time (trace_epoch_ns is its monotonic twin, also the
+     * origin of the open-loop arrival schedules) */
     gettimeofday(&start_time, NULL);
+    trace_epoch_ns = now_ns();
+    
+    pthread_t sampler_thread;
+    if (sample_ms > 0) {
+        sample_out = (sample_path != NULL) ? fopen(sample_path, "w") : stdout;
+        if (sample_out == NULL) {
+            fprintf(stderr, "Error: cannot open %s for writing\n", sample_path);
+            return 1;
+        }
+        pthread_create(&sampler_thread, NULL, sampler, NULL);
+    }
+    pthread_t exporter_thread;
+    if (prom_socket_path != NULL || prom_port > 0) {
+        exporter_fd = open_exporter_socket();
+        if (exporter_fd < 0) {
+            return 1;
+        }
+        if (prom_socket_path != NULL) {
+            printf("Prometheus exporter listening on %s\n\n", prom_socket_path);
+        } else {
+            printf("Prometheus exporter listening on 127.0.0.1:%d\n\n", prom_port);
+        }
+        pthread_create(&exporter_thread, NULL, exporter, NULL);
+    }
     
     /* Create producer threads */
     pthread_t *producers = (pthread_t *)malloc(num_producers * sizeof(pthread_t));
@@ -235,13 +3529,24 @@ int main(int argc, char *argv[]) {
         pthread_create(&producers[i], NULL, producer, id);
     }
     
-    /* Create consumer threads */
-    pthread_t *consumers = (pthread_t *)malloc(num_consumers * sizeof(pthread_t));
-    printf("Creating %d consumer thread(s)...\n\n", num_consumers);
-    for (int i = 0; i < num_consumers; i++) {
-        int *id = (int *)malloc(sizeof(int));
-        *id = i + 1;
-        pthread_create(&consumers[i], NULL, consumer, id);
+    /* Create consumer threads (one set per stage in pipeline mode) */
+    int num_workers = (mode == MODE_QUEUE) ? num_consumers : num_stages * workers_per_stage;
+    consumer_thread_slots = num_workers;  // start_consumer() grows it as the pool scales
+    consumer_threads = (pthread_t *)malloc(consumer_thread_slots * sizeof(pthread_t));
+    printf("Creating %d consumer thread(s)...\n\n", num_workers);
+    for (int i = 0; i < num_workers; i++) {
+        if (mode != MODE_QUEUE) {
+            int *id = (int *)malloc(sizeof(int));
+            *id = i;
+            pthread_create(&consumer_threads[i], NULL, stage_worker, id);
+            consumers_started++;
+        } else if (start_consumer() != 0) {
+            return 1;
+        }
+    }
+    pthread_t controller_thread;
+    if (max_consumers > 0) {
+        pthread_create(&controller_thread, NULL, controller, NULL);
     }
     
     /* Wait for all producers to finish */
@@ -250,25 +3555,70 @@ int main(int argc, char *argv[]) {
     }
     printf("\nAll producers finished.\n");
     
+    if (max_consumers > 0) {
+        /* Close the elastic pool: consumers drain the buffer, then exit */
+        __atomic_store_n(&controller_stop, 1, __ATOMIC_SEQ_CST);
+        pthread_join(controller_thread, NULL);
+        printf("Closing queue for %d consumer(s)...\n", live_consumers);
+        sem_wait(&queue.mutex);
+        queue_closed = 1;
+        sem_post(&queue.mutex);
+        for (int i = 0; i < live_consumers; i++) {
+            sem_post(&queue.full);
+        }
+    }
+    
+    if (mode != MODE_QUEUE) {
+        /* No pills needed: stages stop once their cursor reaches the end */
+        __atomic_store_n(&seq_end, __atomic_load_n(&claim_seq, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&seq_lock);
+        pthread_cond_broadcast(&seq_cond);
+        pthread_mutex_unlock(&seq_lock);
+    }
+    
     /* Insert poison pills for consumers */
-    printf("Inserting %d poison pill(s)...\n", num_consumers);
-    for (int i = 0; i < num_consumers; i++) {
+    int use_pills = (mode == MODE_QUEUE && max_consumers == 0);
+    if (use_pills) {
+        printf("Inserting %d poison pill(s)...\n", num_consumers);
+    }
+    for (int i = 0; i < num_consumers && use_pills; i++) {
         item poison;
         poison.value = POISON_PILL;
         poison.priority = -1;  // LOWEST priority - consumed AFTER all real items
         gettimeofday(&poison.timestamp, NULL);
+        poison.deadline.tv_sec = LONG_MAX;  // latest deadline - consumed last under EDF too
+        poison.deadline.tv_usec = 0;
+        poison.producer_id = i;  // one pill per lane under POLICY_KEYED
+        poison.seq = 0;
+        poison.payload = -1;
         insert_item(poison);
     }
     
-    /* Wait for all consumers to finish */
-    for (int i = 0; i < num_consumers; i++) {
-        pthread_join(consumers[i], NULL);
+    /* Wait for all consumers to finish (including retired ones) */
+    for (int i = 0; i < consumers_started; i++) {
+        pthread_join(consumer_threads[i], NULL);
     }
     printf("All consumers finished.\n\n");
     
     /* Record end time */
     gettimeofday(&end_time, NULL);
     
+    if (sample_ms > 0) {
+        __atomic_store_n(&sampler_stop, 1, __ATOMIC_SEQ_CST);
+        pthread_join(sampler_thread, NULL);
+        if (sample_out != stdout) {
+            fclose(sample_out);
+        }
+    }
+    if (exporter_fd >= 0) {
+        __atomic_store_n(&exporter_stop, 1, __ATOMIC_SEQ_CST);
+        pthread_join(exporter_thread, NULL);
+        close(exporter_fd);
+        if (prom_socket_path != NULL) {
+            unlink(prom_socket_path);
+        }
+    }
+    
     /* Calculate and display metrics (bonus feature) */
     double total_time = (end_time.tv_sec - start_time.tv_sec) +
                        (end_time.tv_usec - start_time.tv_usec) / 1000000.0;
@@ -281,18 +3631,204 @@ int main(int argc, char *argv[]) {
     printf("Total execution time: %.6f seconds\n", total_time);
     printf("Average latency: %.6f seconds\n", avg_latency);
     printf("Throughput: %.2f items/second\n", throughput);
+    int total_misses = 0;
+    for (int c = num_levels - 1; c >= 0; c--) {
+        char label[16];
+        printf("%s items: %d consumed, avg latency %.6f s, max latency %.6f s, "
+               "%d deadline misses\n",
+               priority_label(c, label, sizeof(label)), class_consumed[c],
+               class_consumed[c] > 0 ? class_total_latency[c] / class_consumed[c] : 0.0,
+               class_max_latency[c], deadline_misses[c]);
+        total_misses += deadline_misses[c];
+    }
+    printf("Deadline misses: %d (max lateness %.6f s)\n", total_misses, max_lateness);
+    printf("Per-producer order violations: %d\n", order_violations);
+    int verify_failed = (verify && verify_report() != 0);
+    if (arrival_rate > 0 || replay_path != NULL) {
+        printf("Open loop: offered %.2f items/s", last_arrival > 0 ? total_produced / last_arrival : 0.0);
+        if (arrival_rate > 0) {
+            printf(" (target %.2f)", arrival_rate);
+        }
+        printf(", %d of %d sends started >1 ms late, send lag p99 %.6f s, max %.6f s\n",
+               late_sends, total_produced,
+               fmin(hist_percentile(&send_lag_hist, 0.99), max_send_lag), max_send_lag);
+    }
+    if (replay_path != NULL) {
+        stats_snapshot snap;
+        take_snapshot(&snap);
+        printf("Replay vs recording: throughput %.2f vs %.2f items/s, avg latency %.6f vs %.6f s, "
+               "p99 latency %.6f vs %.6f s\n",
+               throughput, replay_info.throughput, avg_latency, replay_info.avg_latency_s,
+               hist_percentile(&snap.latency, 0.99), replay_info.p99_latency_s);
+    }
+    if (work_enabled(&producer_work) || work_enabled(&consumer_work)) {
+        long work_items[2] = {0, 0}, work_ns[2] = {0, 0};
+        int threads[2] = {0, 0};
+        for (thread_stats *ts = stats_registry; ts != NULL; ts = ts->next) {
+            int r = (ts->role == 'P') ? 0 : 1;
+            threads[r]++;
+            work_items[r] += ts->work_items;
+            work_ns[r] += ts->work_ns;
+        }
+        for (int r = 0; r < 2; r++) {
+            if (work_items[r] > 0) {
+                printf("%s work: %.2f us per item, %.1f%% of their time\n",
+                       r ? "Consumer" : "Producer", work_ns[r] / 1e3 / work_items[r],
+                       total_time > 0 ? 100.0 * work_ns[r] / 1e9 / (threads[r] * total_time) : 0.0);
+            }
+        }
+    }
+    print_wait_stats(total_time);
+    if (perf_enabled) {
+        print_perf_stats();
+    }
+    if (payload_bytes > 0) {
+        print_payload_stats();
+    }
+    if (max_consumers > 0) {
+        printf("Autoscaling: %d scale-up(s), %d scale-down(s), peak %d consumers, "
+               "%d threads started\n", scale_ups, scale_downs, peak_consumers, consumers_started);
+    }
+    if (mode == MODE_BROADCAST) {
+        for (int t = 0; t < num_stages; t++) {
+            printf("Group %d: %ld items, avg latency %.6f s, max latency %.6f s, "
+                   "avg lag %.1f, max lag %ld\n",
+                   t + 1, stage_items[t],
+                   stage_items[t] > 0 ? stage_total_latency[t] / stage_items[t] : 0.0,
+                   stage_max_latency[t],
+                   stage_items[t] > 0 ? (double)stage_depth_sum[t] / stage_items[t] : 0.0,
+                   stage_depth_max[t]);
+        }
+    }
+    if (mode == MODE_PIPELINE) {
+        for (int t = 0; t < num_stages; t++) {
+            printf("Stage %d (%s): %ld items, avg latency %.6f s, max latency %.6f s, "
+                   "avg depth %.1f, max depth %ld\n",
+                   t + 1, stage_name(t), stage_items[t],
+                   stage_items[t] > 0 ? stage_total_latency[t] / stage_items[t] : 0.0,
+                   stage_max_latency[t],
+                   stage_items[t] > 0 ? (double)stage_depth_sum[t] / stage_items[t] : 0.0,
+                   stage_depth_max[t]);
+        }
+        if (num_stages > 2) {
+            printf("Aggregate checksum: %ld\n", aggregate_sum);
+        }
+    }
+    if (mode == MODE_QUEUE && policy == POLICY_KEYED) {
+        long lane_min = lanes[0].consumed, lane_max = lanes[0].consumed;
+        for (int c = 0; c < num_consumers; c++) {
+            printf("  Lane %d: %ld items\n", c + 1, lanes[c].consumed);
+            if (lanes[c].consumed < lane_min) {
+                lane_min = lanes[c].consumed;
+            }
+            if (lanes[c].consumed > lane_max) {
+                lane_max = lanes[c].consumed;
+            }
+        }
+        double lane_mean = (double)total_consumed / num_consumers;
+        printf("Lane imbalance: min %ld, max %ld, mean %.1f, max/mean %.2f\n",
+               lane_min, lane_max, lane_mean, lane_mean > 0 ? lane_max / lane_mean : 0.0);
+    }
+    if (policy == POLICY_DRR) {
+        /* Fairness check: while every level is backlogged (overload) each
+         * should get weight / sum(weights) of the dequeues. The share over
+         * the whole run is shown too; it only matches the weights when the
+         * levels stay overloaded for most of the run. */
+        long saturated = 0;
+        int weight_sum = 0;
+        for (int l = 0; l < num_levels; l++) {
+            saturated += drr_saturated[l];
+            weight_sum += level_weight[l];
+        }
+        printf("DRR fairness (%ld of %d dequeues, %.1f%%, made with all levels backlogged):\n",
+               saturated, total_consumed,
+               total_consumed > 0 ? 100.0 * saturated / total_consumed : 0.0);
+        for (int l = num_levels - 1; l >= 0; l--) {
+            char label[16];
+            printf("  %s: configured share %.1f%%, achieved %.1f%% while backlogged, "
+                   "%.1f%% overall, throughput %.2f items/s\n",
+                   priority_label(l, label, sizeof(label)),
+                   100.0 * level_weight[l] / weight_sum,
+                   saturated > 0 ? 100.0 * drr_saturated[l] / saturated : 0.0,
+                   total_consumed > 0 ? 100.0 * class_consumed[l] / total_consumed : 0.0,
+                   total_time > 0 ? class_consumed[l] / total_time : 0.0);
+        }
+    }
+    print_histogram("lateness", &lateness_hist);
     printf("=========================================\n");
     
+    if (record_path != NULL) {
+        stats_snapshot snap;
+        take_snapshot(&snap);
+        if (write_recording(record_path, total_time, avg_latency,
+                            hist_percentile(&snap.latency, 0.99)) == 0) {
+            printf("Workload recorded to %s (%d arrivals)\n", record_path, total_produced);
+        } else {
+            fprintf(stderr, "Error: cannot write workload recording to %s\n", record_path);
+        }
+    }
+    if (trace_path != NULL) {
+        if (write_trace(trace_path) == 0) {
+            printf("Trace written to %s (open in https://ui.perfetto.dev)\n", trace_path);
+        } else {
+            fprintf(stderr, "Error: cannot write trace to %s\n", trace_path);
+        }
+    }
+    
+    if (metrics_format != METRICS_TEXT) {
+        FILE *mf = (metrics_path != NULL) ? fopen(metrics_path, "w") : stdout;
+        if (mf == NULL) {
+            fprintf(stderr, "Error: cannot open %s for writing\n", metrics_path);
+        } else {
+            write_metrics(mf, metrics_format == METRICS_JSON, total_time);
+            if (mf != stdout) {
+                fclose(mf);
+            }
+        }
+    }
+    
     /* Cleanup */
-    free(buffer);
+    item_queue_destroy(&queue);
+    if (payload_bytes > 0) {
+        payload_pool_destroy(&pool);
+    }
+    level_fifos_destroy();
+    if (lanes != NULL) {
+        for (int c = 0; c < num_consumers; c++) {
+            item_fifo_destroy(&lanes[c].q);
+        }
+        free(lanes);
+    }
+    free(last_seq);
+    free(replay_events);
+    free(replay_first);
+    free(replay_count);
+    if (mode != MODE_QUEUE) {
+        free(slot_published);
+        free(slot_done);
+        free(stage_cursor);
+        pthread_mutex_destroy(&seq_lock);
+        pthread_cond_destroy(&seq_cond);
+    }
     free(producers);
-    free(consumers);
-    sem_destroy(&mutex);
-    sem_destroy(&empty);
-    sem_destroy(&full);
+    free(consumer_threads);
+    while (stats_registry != NULL) {
+        thread_stats *next = stats_registry->next;
+        free(stats_registry->trace);
+        free(stats_registry->work_set);
+        free(stats_registry->seen);
+        free(stats_registry->seen_last);
+        free(stats_registry->recorded);
+        free(stats_registry);
+        stats_registry = next;
+    }
     pthread_mutex_destroy(&stats_lock);
     
+    if (verify_failed) {
+        printf("\nProgram completed, exactly-once verification FAILED.\n");
+        return 1;
+    }
     printf("\nProgram completed successfully.\n");
     return 0;
 }
-
+#endif /* PC_NO_MAIN */